@@ -1,9 +1,16 @@
 #include <benchmark/benchmark.h>
 
 #include <cstdlib>
+#include <cstring>
 #include <list>
+#include <map>
 #include <sstream>
 #include <iostream>
+
+#include <unistd.h>
+
+#include "extent_server.h"
+#include "inode_manager.h"
 using namespace std;
 typedef unsigned long long inum;
 
@@ -154,4 +161,159 @@ static void parse2(benchmark::State& state) {
 BENCHMARK(parse);
 BENCHMARK(parse2);
 
+// Two files appended to in turn, so each one ends up as 400 one-block
+// extents spread over 7 extent blocks. Return the first one.
+static uint32_t fragmented_files(inode_manager& im) {
+    im.set_delalloc(false);
+    uint32_t a = im.alloc_inode(extent_protocol::T_FILE);
+    uint32_t b = im.alloc_inode(extent_protocol::T_FILE);
+    std::string da, db;
+    for (int i = 0; i < 400; i++) {
+        da.append(BLOCK_SIZE, 'a');
+        db.append(BLOCK_SIZE, 'b');
+        im.write_file(a, da.data(), da.size());
+        im.write_file(b, db.data(), db.size());
+    }
+    return a;
+}
+
+// Read the first file whole, with the extent map cache off (0) or on (1).
+static void BM_ReadFragmentedFile(benchmark::State& state) {
+    inode_manager im;
+    im.set_map_cache(state.range(0) ? MAP_CACHE_SIZE : 0);
+    uint32_t a = fragmented_files(im);
+    for (auto _ : state) {
+        char* buf = NULL;
+        int size = 0;
+        im.read_file(a, &buf, &size);
+        free(buf);
+    }
+}
+BENCHMARK(BM_ReadFragmentedFile)->Arg(0)->Arg(1);
+
+// Read one block at a time, all over the same file, where finding the block
+// costs more than copying it.
+static void BM_ReadFragmentedBlock(benchmark::State& state) {
+    inode_manager im;
+    im.set_map_cache(state.range(0) ? MAP_CACHE_SIZE : 0);
+    uint32_t a = fragmented_files(im);
+    char buf[BLOCK_SIZE];
+    uint32_t i = 0;
+    for (auto _ : state) {
+        i = (i * 7 + 13) % 400;
+        im.read_range(a, i * BLOCK_SIZE, BLOCK_SIZE, buf);
+        benchmark::DoNotOptimize(buf);
+    }
+}
+BENCHMARK(BM_ReadFragmentedBlock)->Arg(0)->Arg(1);
+
+// getattr over 1000 files, served by the buffer cache after the first pass.
+static void BM_Getattr(benchmark::State& state) {
+    inode_manager im;
+    std::vector<extent_protocol::extentid_t> inums =
+        im.alloc_ninode(extent_protocol::T_FILE, 1000);
+    size_t i = 0;
+    for (auto _ : state) {
+        extent_protocol::attr a;
+        im.getattr(inums[i++ % inums.size()], a);
+        benchmark::DoNotOptimize(a);
+    }
+    uint64_t hits, misses, writebacks;
+    im.cache_stats(hits, misses, writebacks);
+    state.counters["hit_rate"] = (double)hits / (hits + misses);
+}
+BENCHMARK(BM_Getattr);
+
+// CRC32C of one block.
+static void BM_Crc32c(benchmark::State& state) {
+    char blk[BLOCK_SIZE];
+    memset(blk, 'x', sizeof(blk));
+    for (auto _ : state) benchmark::DoNotOptimize(crc32c(0, blk, sizeof(blk)));
+    state.SetBytesProcessed(state.iterations() * BLOCK_SIZE);
+}
+BENCHMARK(BM_Crc32c);
+
+// Read a 64 KiB file and getattr it, checking no block (0), each block once
+// after it was written (1) or every block read (2).
+static void BM_ReadVerified(benchmark::State& state) {
+    inode_manager im;
+    im.set_verify(state.range(0));
+    im.set_delalloc(false);
+    uint32_t inum = im.alloc_inode(extent_protocol::T_FILE);
+    std::string data(64 * 1024, 'v');
+    im.write_file(inum, data.data(), data.size());
+    for (auto _ : state) {
+        char* buf = NULL;
+        int size = 0;
+        extent_protocol::attr a;
+        im.getattr(inum, a);
+        im.read_file(inum, &buf, &size);
+        free(buf);
+    }
+}
+BENCHMARK(BM_ReadVerified)->Arg(VERIFY_NONE)->Arg(VERIFY_MISS)->Arg(VERIFY_ALL);
+
+// Copy 64 KiB a 1 KiB block at a time and check each block for zeros, as
+// the per-block loops of the inode layer do, with the block size a
+// compile-time constant through with_block_size (1) or a plain value (0).
+static void BM_WithBlockSize(benchmark::State& state) {
+    uint32_t bs = 1024;
+    benchmark::DoNotOptimize(bs);
+    std::vector<char> src(64 * 1024, 'w'), dst(src.size());
+    auto copy = [&](auto n) {
+        for (size_t off = 0; off < src.size(); off += n) {
+            memcpy(&dst[off], &src[off], n);
+            const uint64_t* w = (const uint64_t*)&dst[off];
+            bool zero = true;
+            for (size_t i = 0; i < n / sizeof(uint64_t); i++)
+                if (w[i]) zero = false;
+            benchmark::DoNotOptimize(zero);
+        }
+    };
+    for (auto _ : state) {
+        if (state.range(0))
+            with_block_size(bs, copy);
+        else
+            copy(bs);
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * src.size());
+}
+BENCHMARK(BM_WithBlockSize)->Arg(0)->Arg(1);
+
+// 4 KiB writes to a file of each thread's own on a journaled image, with
+// the requests run on the RPC threads (0) or on 4 shard workers (4), the
+// commits waited for off the workers. Each thread stands for an RPC thread.
+static void BM_ShardedWrite(benchmark::State& state) {
+    // one server per shard count, set up on its first run, never freed as
+    // its shard workers run for good
+    static std::map<int64_t, extent_server*> servers;
+    static extent_server* es;
+    static std::vector<extent_protocol::extentid_t> files;
+    if (state.thread_index() == 0) {
+        es = servers[state.range(0)];
+        if (es == NULL) {
+            std::string image = "/tmp/bench-shards-" +
+                                std::to_string(state.range(0)) + ".img";
+            for (const char* ext : {"", ".crc", ".journal"})
+                unlink((image + ext).c_str());
+            es = servers[state.range(0)] = new extent_server(
+                image.c_str(), false, geometry_t(), state.range(0));
+        }
+        files.clear();
+        for (int i = 0; i < state.threads(); i++) {
+            extent_protocol::extentid_t id = 0;
+            es->create(extent_protocol::T_FILE, 0, id);
+            files.push_back(id);
+        }
+    }
+    std::string data(4096, 'w');
+    for (auto _ : state) {
+        int written;
+        es->write(files[state.thread_index()], 0, data, written);
+    }
+    state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_ShardedWrite)->Arg(0)->Arg(4)->Threads(4)->UseRealTime();
+
 BENCHMARK_MAIN();
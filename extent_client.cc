@@ -6,6 +6,7 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <ctime>
 #include <iostream>
 #include <sstream>
@@ -33,10 +34,13 @@ extent_client::extent_client(std::string dst) {
     }
 }
 
-extent_protocol::status extent_client::create(uint32_t type,
-                                              extent_protocol::extentid_t &id) {
+// Create a file in directory parent (0 if unknown), the server keeps them
+// close
+extent_protocol::status extent_client::create(
+    uint32_t type, extent_protocol::extentid_t &id,
+    extent_protocol::extentid_t parent) {
     extent_protocol::status ret = extent_protocol::OK;
-    ret = cl->call(extent_protocol::create, type, id);
+    ret = cl->call(extent_protocol::create, type, parent, id);
     return ret;
 }
 
@@ -62,6 +66,25 @@ extent_protocol::status extent_client::put(extent_protocol::extentid_t eid,
     return ret;
 }
 
+// Read at most len bytes of eid at off, only those cross the network
+extent_protocol::status extent_client::read(extent_protocol::extentid_t eid,
+                                            uint32_t off, uint32_t len,
+                                            std::string &buf) {
+    extent_protocol::status ret = extent_protocol::OK;
+    ret = cl->call(extent_protocol::read, eid, off, len, buf);
+    return ret;
+}
+
+// Write buf into eid at off, growing it if need be
+extent_protocol::status extent_client::write(extent_protocol::extentid_t eid,
+                                             uint32_t off,
+                                             const std::string &buf,
+                                             int &written) {
+    extent_protocol::status ret = extent_protocol::OK;
+    ret = cl->call(extent_protocol::write, eid, off, buf, written);
+    return ret;
+}
+
 extent_protocol::status extent_client::remove(extent_protocol::extentid_t eid) {
     extent_protocol::status ret = extent_protocol::OK;
     int r;
@@ -69,25 +92,97 @@ extent_protocol::status extent_client::remove(extent_protocol::extentid_t eid) {
     return ret;
 }
 
+// Create a file sharing the blocks of src on the server, copy-on-write
+extent_protocol::status extent_client::clone(extent_protocol::extentid_t src,
+                                             extent_protocol::extentid_t &eid) {
+    extent_protocol::status ret = extent_protocol::OK;
+    ret = cl->call(extent_protocol::clone, src, eid);
+    return ret;
+}
+
+// Find the file named name in directory dir, NOENT if there is none. Only
+// the entry crosses the network, as for dir_add and dir_remove.
+extent_protocol::status extent_client::dir_lookup(
+    extent_protocol::extentid_t dir, const std::string &name,
+    extent_protocol::extentid_t &eid) {
+    return cl->call(extent_protocol::dir_lookup, dir, name, eid);
+}
+
+// Add an entry for eid named name to directory dir, EXIST if there is one
+extent_protocol::status extent_client::dir_add(
+    extent_protocol::extentid_t dir, const std::string &name,
+    extent_protocol::extentid_t eid) {
+    int r;
+    return cl->call(extent_protocol::dir_add, dir, name, eid, r);
+}
+
+// Remove the entry named name from directory dir, returning its file in eid
+extent_protocol::status extent_client::dir_remove(
+    extent_protocol::extentid_t dir, const std::string &name,
+    extent_protocol::extentid_t &eid) {
+    return cl->call(extent_protocol::dir_remove, dir, name, eid);
+}
+
+// List directory dir with the attributes of its files, in one round trip
+extent_protocol::status extent_client::readdirplus(
+    extent_protocol::extentid_t dir,
+    std::vector<extent_protocol::dirent> &ents) {
+    ents.clear();
+    return cl->call(extent_protocol::readdirplus, dir, ents);
+}
+
+// Take a snapshot of every file as the server has it, data still cached
+// dirty by the clients is not in it.
+extent_protocol::status extent_client::snapshot() {
+    int r;
+    return cl->call(extent_protocol::snapshot, 0, r);
+}
+
+extent_protocol::status extent_client::drop_snapshot() {
+    int r;
+    return cl->call(extent_protocol::drop_snapshot, 0, r);
+}
+
+// Run ops on the server in one round trip, see extent_server::compound.
+// Return the status of the first op that failed, if one did.
+extent_protocol::status extent_client::compound(
+    const std::vector<extent_protocol::op> &ops,
+    std::vector<extent_protocol::result> &results) {
+    extent_protocol::status ret = extent_protocol::OK;
+    results.clear();
+    ret = cl->call(extent_protocol::compound, ops, results);
+    if (ret != extent_protocol::OK) return ret;
+    if (!results.empty() && results.back().st != extent_protocol::OK)
+        return results.back().st;
+    if (results.size() != ops.size()) return extent_protocol::RPCERR;
+    return ret;
+}
+
 extent_protocol::status extent_client::flush(extent_protocol::extentid_t eid) {
     // No cache, do nothing
     return extent_protocol::OK;
 }
 
+void extent_client::lock_granted(extent_protocol::extentid_t eid) {
+    // No cache, do nothing
+}
+
 /**
  * Cached Version
  */
 
 shared_ptr<cached_file> extent_client_cache::cachedGet(
     extent_protocol::extentid_t id) {
-    auto file = cache[id];
+    auto file = lookup(id);
     if (file == NULL) {
         // cache miss: fetch data
         std::string buf;
         extent_client::get(id, buf);
         auto filePtr = std::make_shared<cached_file>();
         filePtr->data = buf;
+        pthread_mutex_lock(&cache_lock);
         cache[id] = filePtr;
+        pthread_mutex_unlock(&cache_lock);
         return filePtr;
     }
     return file;
@@ -95,15 +190,27 @@ shared_ptr<cached_file> extent_client_cache::cachedGet(
 
 shared_ptr<cached_file> extent_client_cache::lookup(
     extent_protocol::extentid_t id) const {
-    if (cache.find(id) == cache.end()) return NULL;
-    auto file = cache.at(id);
+    shared_ptr<cached_file> file;
+    pthread_mutex_lock(&cache_lock);
+    auto it = cache.find(id);
+    if (it != cache.end()) file = it->second;
+    pthread_mutex_unlock(&cache_lock);
     return file;
 }
 
-shared_ptr<cached_file> extent_client_cache::setCachedFileData(
-    extent_protocol::extentid_t id, std::string &buf) {
+// The cached file of id, made if there is none. Called with cache_lock held.
+shared_ptr<cached_file> &extent_client_cache::cached(
+    extent_protocol::extentid_t id) {
     auto &fp = cache[id];
     if (fp == NULL) fp = std::make_shared<cached_file>();
+    return fp;
+}
+
+shared_ptr<cached_file> extent_client_cache::setCachedFileData(
+    extent_protocol::extentid_t id, std::string &buf) {
+    pthread_mutex_lock(&cache_lock);
+    shared_ptr<cached_file> fp = cached(id);
+    pthread_mutex_unlock(&cache_lock);
     fp->dataValid = true;
     fp->data = buf;
     fp->attrValid = false;
@@ -112,8 +219,9 @@ shared_ptr<cached_file> extent_client_cache::setCachedFileData(
 
 shared_ptr<cached_file> extent_client_cache::setCachedFileAttr(
     extent_protocol::extentid_t id, extent_protocol::attr &a) {
-    auto &fp = cache[id];
-    if (fp == NULL) fp = std::make_shared<cached_file>();
+    pthread_mutex_lock(&cache_lock);
+    shared_ptr<cached_file> fp = cached(id);
+    pthread_mutex_unlock(&cache_lock);
     fp->attrValid = true;
     fp->attr = a;
     return fp;
@@ -121,34 +229,75 @@ shared_ptr<cached_file> extent_client_cache::setCachedFileAttr(
 
 shared_ptr<cached_file> extent_client_cache::cacheRemove(
     extent_protocol::extentid_t id) {
-    auto &fp = cache[id];
-    if (fp == NULL) fp = std::make_shared<cached_file>();
+    pthread_mutex_lock(&cache_lock);
+    shared_ptr<cached_file> fp = cached(id);
+    pthread_mutex_unlock(&cache_lock);
     fp->remove = true;
     return fp;
 }
 
+// Take the hint listed for eid if it is fresh, it is of no use again.
+bool extent_client_cache::take_hint(extent_protocol::extentid_t eid,
+                                    extent_protocol::attr &a) {
+    bool fresh = false;
+    pthread_mutex_lock(&cache_lock);
+    auto hint = hints.find(eid);
+    if (hint != hints.end()) {
+        fresh = std::time(nullptr) - hint->second.time <= ATTR_HINT_TTL;
+        a = hint->second.a;
+        hints.erase(hint);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return fresh;
+}
+
+void extent_client_cache::drop_hint(extent_protocol::extentid_t eid) {
+    pthread_mutex_lock(&cache_lock);
+    hints.erase(eid);
+    pthread_mutex_unlock(&cache_lock);
+}
+
 extent_client_cache::extent_client_cache(std::string dst)
-    : extent_client(dst) {}
+    : extent_client(dst), ag_inodes(0), grants(0) {
+    VERIFY(pthread_mutex_init(&prealloc_lock, NULL) == 0);
+    VERIFY(pthread_mutex_init(&cache_lock, NULL) == 0);
+}
 
 extent_protocol::status extent_client_cache::create(
-    uint32_t type, extent_protocol::extentid_t &eid) {
+    uint32_t type, extent_protocol::extentid_t &eid,
+    extent_protocol::extentid_t parent) {
     extent_protocol::status st = extent_protocol::OK;
-    // pre-create for T_FILE
+    // pre-create for T_FILE, in the group of parent
     if (type == extent_protocol::T_FILE) {
+        pthread_mutex_lock(&prealloc_lock);
+        if (ag_inodes == 0) {
+            int n = 0;
+            st = cl->call(extent_protocol::inode_groups, 0, n);
+            if (st != extent_protocol::OK || n <= 0) {
+                pthread_mutex_unlock(&prealloc_lock);
+                return extent_protocol::IOERR;
+            }
+            ag_inodes = n;
+        }
+        auto &preallocated =
+            this->preallocated[(parent & 0x7fffffff) / ag_inodes % AG_COUNT];
         if (preallocated.size() == 0) {
             std::vector<extent_protocol::extentid_t> vec;
-            st = cl->call(extent_protocol::create_n_file, PRE_CREATE_NUM, vec);
+            st = cl->call(extent_protocol::create_n_file, PRE_CREATE_NUM,
+                          parent, vec);
             VERIFY(st == extent_protocol::OK);
             preallocated = vec;
         }
         if (preallocated.size() == 0) {
+            pthread_mutex_unlock(&prealloc_lock);
             std::cerr << "Error: inode used up\n";
             return extent_protocol::IOERR;
         }
         eid = preallocated.back();
         preallocated.pop_back();
+        pthread_mutex_unlock(&prealloc_lock);
     } else
-        st = extent_client::create(type, eid);  // RPC: get an id
+        st = extent_client::create(type, eid, parent);  // RPC: get an id
     LOG("CREATE type %u id %llu\n", type, eid);
     // create in cache
     VERIFY(st == extent_protocol::OK);
@@ -163,7 +312,9 @@ extent_protocol::status extent_client_cache::create(
     file->attr.type = type;
     file->attr.size = 0;
     file->data = "";
+    pthread_mutex_lock(&cache_lock);
     cache[eid] = file;
+    pthread_mutex_unlock(&cache_lock);
     return st;
 }
 
@@ -178,9 +329,24 @@ extent_protocol::status extent_client_cache::get(
         file->attr.atime = std::time(nullptr);
         LOG("GET cached %llu: ^%s$\n", eid, buf.c_str());
     } else {
-        st = extent_client::get(eid, buf);
+        // the attributes come along in the same round trip, as a directory
+        // just got is about to be checked and changed
+        std::vector<extent_protocol::op> ops(2);
+        ops[0].code = extent_protocol::getattr;
+        ops[0].id = eid;
+        ops[1].code = extent_protocol::get;
+        ops[1].id = eid;
+        std::vector<extent_protocol::result> res;
+        st = compound(ops, res);
         if (st != extent_protocol::OK) return st;
-        setCachedFileData(eid, buf);
+        buf = res[1].data;
+        // cached attributes may be newer than those of the server
+        bool attrValid = file && file->attrValid;
+        file = setCachedFileData(eid, buf);
+        if (attrValid)
+            file->attrValid = true;
+        else
+            setCachedFileAttr(eid, res[0].a);
         LOG("GET %llu: %s\n", eid, buf.c_str());
     }
     return st;
@@ -193,6 +359,11 @@ extent_protocol::status extent_client_cache::getattr(
     if (file && file->attrValid) {
         a = file->attr;
         LOG("GETATTR cached %llu size=%u\n", eid, a.size);
+    } else if (take_hint(eid, a)) {
+        // listed just now, and not granted the lock of eid since: cached
+        // from here on, under that lock
+        setCachedFileAttr(eid, a);
+        LOG("GETATTR listed %llu size=%u\n", eid, a.size);
     } else {
         st = extent_client::getattr(eid, a);
         if (st != extent_protocol::OK) return st;
@@ -206,6 +377,7 @@ extent_protocol::status extent_client_cache::put(
     extent_protocol::extentid_t eid, std::string &buf) {
     extent_protocol::status st = extent_protocol::OK;
     LOG("PUT %s\n", buf);
+    drop_hint(eid);
     auto file = lookup(eid);
     if (file && file->dataValid) {
         file->data = buf;
@@ -226,9 +398,60 @@ extent_protocol::status extent_client_cache::put(
     return st;
 }
 
+// A file whose data is cached is read from the cache, else only the range
+// is fetched, and not cached.
+extent_protocol::status extent_client_cache::read(
+    extent_protocol::extentid_t eid, uint32_t off, uint32_t len,
+    std::string &buf) {
+    extent_protocol::status st = extent_protocol::OK;
+    auto file = lookup(eid);
+    if (file && file->dataValid) {
+        buf = off < file->data.size() ? file->data.substr(off, len) : "";
+        file->attr.atime = std::time(nullptr);
+        LOG("READ cached %llu off=%u len=%u\n", eid, off, len);
+    } else {
+        st = extent_client::read(eid, off, len, buf);
+        LOG("READ %llu off=%u len=%u\n", eid, off, len);
+    }
+    return st;
+}
+
+// A file whose data is cached is written in the cache, to be put back when
+// flushed, else the range goes straight to the server.
+extent_protocol::status extent_client_cache::write(
+    extent_protocol::extentid_t eid, uint32_t off, const std::string &buf,
+    int &written) {
+    extent_protocol::status st = extent_protocol::OK;
+    drop_hint(eid);
+    auto file = lookup(eid);
+    if (file && file->dataValid) {
+        if (off + buf.size() > file->data.size())
+            file->data.resize(off + buf.size(), '\0');
+        file->data.replace(off, buf.size(), buf);
+        if (!file->attrValid) extent_client::getattr(eid, file->attr);
+        file->attrValid = true;
+        file->attr.size = file->data.size();
+        file->dataDirty = true;
+        LOG("WRITE cached %llu off=%u len=%zu\n", eid, off, buf.size());
+    } else {
+        st = extent_client::write(eid, off, buf, written);
+        if (st != extent_protocol::OK) return st;
+        LOG("WRITE %llu off=%u len=%zu\n", eid, off, buf.size());
+        if (!file || !file->attrValid) return st;
+        file->attr.size =
+            std::max<size_t>(file->attr.size, off + buf.size());
+    }
+    written = buf.size();
+    time_t now = std::time(nullptr);
+    file->attr.mtime = now;  // less consistency
+    file->attr.ctime = now;
+    return st;
+}
+
 extent_protocol::status extent_client_cache::remove(
     extent_protocol::extentid_t eid) {
     extent_protocol::status st = extent_protocol::OK;
+    drop_hint(eid);
     auto file = lookup(eid);
     if (file) {
         LOG("REMOVE cached %llu\n", eid);
@@ -241,20 +464,202 @@ extent_protocol::status extent_client_cache::remove(
     return st;
 }
 
+extent_protocol::status extent_client_cache::clone(
+    extent_protocol::extentid_t src, extent_protocol::extentid_t &eid) {
+    extent_protocol::status st = extent_protocol::OK;
+    // the server clones what it has, so it must have the latest data
+    auto file = lookup(src);
+    if (file && file->dataDirty) {
+        st = extent_client::put(src, file->data);
+        if (st != extent_protocol::OK) return st;
+        file->dataDirty = false;
+    }
+    st = extent_client::clone(src, eid);
+    LOG("CLONE %llu to %llu\n", src, eid);
+    return st;
+}
+
+// Find the entry named name in the cached data of a directory, as dir_for_each
+// does: return whether there is one, and where it is in off and len.
+static bool cached_dir_find(const cached_file &dir, const std::string &name,
+                            extent_protocol::extentid_t &eid, size_t &off,
+                            size_t &len) {
+    bool found = false;
+    dir_for_each(dir.data, [&](const std::string &n,
+                               extent_protocol::extentid_t inum, size_t o,
+                               size_t l) {
+        if (n != name) return true;
+        found = true;
+        eid = inum;
+        off = o;
+        len = l;
+        return false;
+    });
+    return found;
+}
+
+// The cached attributes of a directory whose size is now size.
+static void cached_dir_touch(cached_file &dir, size_t size) {
+    if (!dir.attrValid) return;
+    time_t now = std::time(nullptr);
+    dir.attr.size = size;
+    dir.attr.mtime = now;  // less consistency
+    dir.attr.ctime = now;
+}
+
+// A directory whose data is cached is looked up in the cache, else on the
+// server.
+extent_protocol::status extent_client_cache::dir_lookup(
+    extent_protocol::extentid_t dir, const std::string &name,
+    extent_protocol::extentid_t &eid) {
+    auto file = lookup(dir);
+    if (file && file->attrValid && file->attr.type != extent_protocol::T_DIR)
+        return extent_protocol::IOERR;
+    if (file && file->dataValid) {
+        size_t off, len;
+        LOG("DIR_LOOKUP cached %llu %s\n", dir, name.c_str());
+        return cached_dir_find(*file, name, eid, off, len)
+                   ? extent_protocol::OK
+                   : extent_protocol::NOENT;
+    }
+    LOG("DIR_LOOKUP %llu %s\n", dir, name.c_str());
+    return extent_client::dir_lookup(dir, name, eid);
+}
+
+// The entry goes to the server, and into the cached data if any. Only a
+// directory whose cached data is dirty, which the server is behind on, is
+// changed in the cache alone, to be put back when flushed.
+extent_protocol::status extent_client_cache::dir_add(
+    extent_protocol::extentid_t dir, const std::string &name,
+    extent_protocol::extentid_t eid) {
+    extent_protocol::status st = extent_protocol::OK;
+    drop_hint(dir);
+    auto file = lookup(dir);
+    extent_protocol::extentid_t old;
+    size_t off, len;
+    if (file && file->dataValid && cached_dir_find(*file, name, old, off, len))
+        return extent_protocol::EXIST;
+    if (!file || !file->dataDirty) {
+        st = extent_client::dir_add(dir, name, eid);
+        if (st != extent_protocol::OK || !file) return st;
+    }
+    LOG("DIR_ADD %llu %s %llu\n", dir, name.c_str(), eid);
+    if (file->dataValid) file->data += dir_entry(name, eid);
+    cached_dir_touch(*file, file->attr.size + dir_entry(name, eid).size());
+    return st;
+}
+
+// As for dir_add.
+extent_protocol::status extent_client_cache::dir_remove(
+    extent_protocol::extentid_t dir, const std::string &name,
+    extent_protocol::extentid_t &eid) {
+    extent_protocol::status st = extent_protocol::OK;
+    drop_hint(dir);
+    auto file = lookup(dir);
+    size_t off, len;
+    bool cached = file && file->dataValid &&
+                  cached_dir_find(*file, name, eid, off, len);
+    if (file && file->dataValid && !cached) return extent_protocol::NOENT;
+    if (!file || !file->dataDirty) {
+        st = extent_client::dir_remove(dir, name, eid);
+        if (st != extent_protocol::OK || !file) return st;
+    }
+    LOG("DIR_REMOVE %llu %s %llu\n", dir, name.c_str(), eid);
+    if (cached) file->data.erase(off, len);
+    if (file->dataDirty)
+        cached_dir_touch(*file, file->data.size());
+    else
+        // the server leaves a tombstone or compacts, see
+        // extent_server::dir_remove, so only it knows the size
+        file->attrValid = false;
+    return st;
+}
+
+// A directory whose cached data is dirty is listed from the cache. Else the
+// listing from the server is cached as the data of dir, and the attributes
+// of its files are kept as hints for getattr, as a listing is mostly
+// followed by a lookup and a getattr of every file in it.
+extent_protocol::status extent_client_cache::readdirplus(
+    extent_protocol::extentid_t dir,
+    std::vector<extent_protocol::dirent> &ents) {
+    extent_protocol::status st = extent_protocol::OK;
+    auto file = lookup(dir);
+    if (file && file->dataDirty) {
+        LOG("READDIRPLUS cached %llu\n", dir);
+        ents.clear();
+        dir_for_each(file->data, [&](const std::string &name,
+                                     extent_protocol::extentid_t inum, size_t,
+                                     size_t) {
+            // no attributes: the cached ones of the files may be changing
+            // under locks not held here
+            extent_protocol::dirent e;
+            e.name = name;
+            e.id = inum;
+            memset(&e.a, 0, sizeof(e.a));
+            ents.push_back(e);
+            return true;
+        });
+        return st;
+    }
+    pthread_mutex_lock(&cache_lock);
+    uint64_t epoch = grants;
+    pthread_mutex_unlock(&cache_lock);
+    st = extent_client::readdirplus(dir, ents);
+    if (st != extent_protocol::OK) return st;
+    LOG("READDIRPLUS %llu: %zu entries\n", dir, ents.size());
+    std::string data;
+    for (const extent_protocol::dirent &e : ents)
+        data += dir_entry(e.name, e.id);
+    // No hints if a lock was granted meanwhile: the listing may be older
+    // than what its holder saw, and lock_granted is past.
+    time_t now = std::time(nullptr);
+    pthread_mutex_lock(&cache_lock);
+    if (grants == epoch) {
+        if (hints.size() + ents.size() > ATTR_HINT_MAX) hints.clear();
+        for (const extent_protocol::dirent &e : ents) {
+            auto f = cache.find(e.id);
+            if (f == cache.end() || !f->second->attrValid)
+                hints[e.id] = {e.a, now};
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    bool attrValid = file && file->attrValid;
+    file = setCachedFileData(dir, data);
+    if (attrValid) file->attrValid = true;
+    return st;
+}
+
 extent_protocol::status extent_client_cache::flush(
     extent_protocol::extentid_t eid) {
     extent_protocol::status st = extent_protocol::OK;
+    drop_hint(eid);
     auto file = lookup(eid);
     if (file) {
-        if (file->dataDirty) {
-            extent_client::put(eid, file->data);
+        // one round trip for both, and no put of a file to be removed
+        std::vector<extent_protocol::op> ops;
+        if (file->dataDirty && !file->remove) {
+            ops.push_back({extent_protocol::put, eid, 0, file->data});
             LOG("FLUSH: %llu put %s\n", eid, file->data.c_str());
         }
         if (file->remove) {
-            extent_client::remove(eid);
+            ops.push_back({extent_protocol::remove, eid});
             LOG("FLUSH: %llu remove\n", eid);
         }
+        std::vector<extent_protocol::result> res;
+        if (!ops.empty()) st = compound(ops, res);
+        pthread_mutex_lock(&cache_lock);
         cache.erase(eid);
+        pthread_mutex_unlock(&cache_lock);
     }
     return st;
 }
+
+// A hint listed before the lock of eid was granted is older than what the
+// last holder left, so it is dropped, and so are those of listings still
+// under way.
+void extent_client_cache::lock_granted(extent_protocol::extentid_t eid) {
+    pthread_mutex_lock(&cache_lock);
+    hints.erase(eid);
+    grants++;
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -3,6 +3,9 @@
 #ifndef extent_client_h
 #define extent_client_h
 
+#include <pthread.h>
+
+#include <ctime>
 #include <memory>
 #include <string>
 #include <unordered_map>
@@ -17,19 +20,47 @@ class extent_client {
    public:
     extent_client(std::string dst);
 
-    virtual extent_protocol::status create(uint32_t type,
-                                           extent_protocol::extentid_t &eid);
+    virtual extent_protocol::status create(
+        uint32_t type, extent_protocol::extentid_t &eid,
+        extent_protocol::extentid_t parent = 0);
     virtual extent_protocol::status get(extent_protocol::extentid_t eid,
                                         std::string &buf);
     virtual extent_protocol::status getattr(extent_protocol::extentid_t eid,
                                             extent_protocol::attr &a);
     virtual extent_protocol::status put(extent_protocol::extentid_t eid,
                                         std::string &buf);
+    virtual extent_protocol::status read(extent_protocol::extentid_t eid,
+                                         uint32_t off, uint32_t len,
+                                         std::string &buf);
+    virtual extent_protocol::status write(extent_protocol::extentid_t eid,
+                                          uint32_t off, const std::string &buf,
+                                          int &written);
     virtual extent_protocol::status remove(extent_protocol::extentid_t eid);
+    virtual extent_protocol::status clone(extent_protocol::extentid_t src,
+                                          extent_protocol::extentid_t &eid);
+    virtual extent_protocol::status dir_lookup(
+        extent_protocol::extentid_t dir, const std::string &name,
+        extent_protocol::extentid_t &eid);
+    virtual extent_protocol::status dir_add(extent_protocol::extentid_t dir,
+                                            const std::string &name,
+                                            extent_protocol::extentid_t eid);
+    virtual extent_protocol::status dir_remove(
+        extent_protocol::extentid_t dir, const std::string &name,
+        extent_protocol::extentid_t &eid);
+    virtual extent_protocol::status readdirplus(
+        extent_protocol::extentid_t dir,
+        std::vector<extent_protocol::dirent> &ents);
+    extent_protocol::status snapshot();
+    extent_protocol::status drop_snapshot();
+    extent_protocol::status compound(
+        const std::vector<extent_protocol::op> &ops,
+        std::vector<extent_protocol::result> &results);
     /**
      * flush cached data (if any)
      */
     virtual extent_protocol::status flush(extent_protocol::extentid_t eid);
+    // the lock of eid was just granted by the lock server
+    virtual void lock_granted(extent_protocol::extentid_t eid);
 };
 
 class cached_file {
@@ -43,13 +74,28 @@ class cached_file {
     std::string data;
 };
 
+// Attributes of files listed by readdirplus are kept for this many seconds
+// as hints, or until the lock of the file is granted, see
+// extent_client_cache::getattr and lock_granted
+#define ATTR_HINT_TTL 1
+#define ATTR_HINT_MAX 4096
+
 class extent_client_cache : public extent_client {
    private:
-    std::vector<extent_protocol::extentid_t> preallocated;
+    // per allocation group, see extent_server::create_n_file, the group of
+    // a file following from the inodes per group of the server, 0 until
+    // asked
+    std::vector<extent_protocol::extentid_t> preallocated[AG_COUNT];
+    uint32_t ag_inodes;
+    pthread_mutex_t prealloc_lock;  // guards preallocated and ag_inodes
 
+    // A cached_file is guarded by the lock of its file, the maps of them
+    // and of the hints by cache_lock.
     std::unordered_map<extent_protocol::extentid_t,
                        std::shared_ptr<cached_file>>
         cache;
+    mutable pthread_mutex_t cache_lock;
+    std::shared_ptr<cached_file> &cached(extent_protocol::extentid_t id);
     std::shared_ptr<cached_file> setCachedFileData(
         extent_protocol::extentid_t id, std::string &buf);
     std::shared_ptr<cached_file> setCachedFileAttr(
@@ -58,10 +104,22 @@ class extent_client_cache : public extent_client {
     std::shared_ptr<cached_file> lookup(extent_protocol::extentid_t id) const;
     std::shared_ptr<cached_file> cacheRemove(extent_protocol::extentid_t id);
 
+    typedef struct attr_hint {
+        extent_protocol::attr a;
+        time_t time;  // when it was listed
+    } attr_hint_t;
+    std::unordered_map<extent_protocol::extentid_t, attr_hint_t> hints;
+    // locks granted so far: the hints of a listing that was under way
+    // while one was are dropped
+    uint64_t grants;
+    bool take_hint(extent_protocol::extentid_t eid, extent_protocol::attr &a);
+    void drop_hint(extent_protocol::extentid_t eid);
+
    public:
     extent_client_cache(std::string dst);
     extent_protocol::status create(uint32_t type,
-                                   extent_protocol::extentid_t &eid);
+                                   extent_protocol::extentid_t &eid,
+                                   extent_protocol::extentid_t parent = 0);
     extent_protocol::status create_n(uint32_t type,
                                      extent_protocol::extentid_t &eid, int n);
     extent_protocol::status get(extent_protocol::extentid_t eid,
@@ -70,8 +128,28 @@ class extent_client_cache : public extent_client {
                                     extent_protocol::attr &a);
     extent_protocol::status put(extent_protocol::extentid_t eid,
                                 std::string &buf);
+    extent_protocol::status read(extent_protocol::extentid_t eid, uint32_t off,
+                                 uint32_t len, std::string &buf);
+    extent_protocol::status write(extent_protocol::extentid_t eid,
+                                  uint32_t off, const std::string &buf,
+                                  int &written);
     extent_protocol::status remove(extent_protocol::extentid_t eid);
+    extent_protocol::status clone(extent_protocol::extentid_t src,
+                                  extent_protocol::extentid_t &eid);
+    extent_protocol::status dir_lookup(extent_protocol::extentid_t dir,
+                                       const std::string &name,
+                                       extent_protocol::extentid_t &eid);
+    extent_protocol::status dir_add(extent_protocol::extentid_t dir,
+                                    const std::string &name,
+                                    extent_protocol::extentid_t eid);
+    extent_protocol::status dir_remove(extent_protocol::extentid_t dir,
+                                       const std::string &name,
+                                       extent_protocol::extentid_t &eid);
+    extent_protocol::status readdirplus(
+        extent_protocol::extentid_t dir,
+        std::vector<extent_protocol::dirent> &ents);
     virtual extent_protocol::status flush(extent_protocol::extentid_t eid);
+    virtual void lock_granted(extent_protocol::extentid_t eid);
 };
 
 #endif
\ No newline at end of file
@@ -3,13 +3,15 @@
 #ifndef extent_protocol_h
 #define extent_protocol_h
 
+#include <stdlib.h>
+
 #include "rpc.h"
 
 class extent_protocol {
    public:
     typedef int status;
     typedef unsigned long long extentid_t;
-    enum xxstatus { OK, RPCERR, NOENT, IOERR };
+    enum xxstatus { OK, RPCERR, NOENT, IOERR, EXIST, NOSPC, FBIG };
     enum rpc_numbers {
         put = 0x6001,
         get,
@@ -17,6 +19,18 @@ class extent_protocol {
         remove,
         create,
         create_n_file,
+        clone,
+        snapshot,
+        drop_snapshot,
+        fsck,
+        read,
+        write,
+        compound,
+        dir_lookup,
+        dir_add,
+        dir_remove,
+        readdirplus,
+        inode_groups,
     };
 
     enum types {
@@ -32,8 +46,75 @@ class extent_protocol {
         unsigned int ctime;
         unsigned int size;
     };
+
+    // One operation of a compound request, see extent_server::compound:
+    // code is get, getattr, put, create or remove, id the file or, for
+    // create, the parent, type the type to create and data what to put.
+    struct op {
+        uint32_t code;
+        extentid_t id;
+        uint32_t type = 0;
+        std::string data;
+    };
+
+    // The result of an op: id the file created, a its attributes for
+    // getattr, data what get got.
+    struct result {
+        status st = OK;
+        extentid_t id = 0;
+        attr a = {};
+        std::string data;
+    };
+
+    // An entry of a directory listing with the attributes of its file, see
+    // extent_server::readdirplus
+    struct dirent {
+        std::string name;
+        extentid_t id;
+        attr a;
+    };
 };
 
+// A directory holds its entries back to back, each "name/inum/". A removed
+// entry may be left in place as a tombstone of the same length, with inum
+// 0, which no file has. Call fn(name, inum, off, len) for each entry but
+// the tombstones, of len bytes at off, until it returns false.
+template <class F>
+inline void dir_for_each(const std::string &buf, F fn) {
+    size_t off = 0;
+    while (off < buf.size()) {
+        size_t a = buf.find('/', off);
+        size_t b = a == std::string::npos ? a : buf.find('/', a + 1);
+        if (b == std::string::npos) break;
+        extent_protocol::extentid_t inum =
+            strtoull(buf.c_str() + a + 1, NULL, 10);
+        if (inum != 0 && !fn(buf.substr(off, a - off), inum, off, b + 1 - off))
+            break;
+        off = b + 1;
+    }
+}
+
+inline std::string dir_entry(const std::string &name,
+                             extent_protocol::extentid_t inum) {
+    return name + "/" + std::to_string(inum) + "/";
+}
+
+// A tombstone for an entry of len bytes, at least "a/1/".
+inline std::string dir_tombstone(size_t len) {
+    return std::string(len - 3, '.') + "/0/";
+}
+
+// The entries of a directory without its tombstones.
+inline std::string dir_compact(const std::string &buf) {
+    std::string out;
+    dir_for_each(buf, [&](const std::string &, extent_protocol::extentid_t,
+                          size_t off, size_t len) {
+        out.append(buf, off, len);
+        return true;
+    });
+    return out;
+}
+
 inline unmarshall &operator>>(unmarshall &u, extent_protocol::attr &a) {
     u >> a.type;
     u >> a.atime;
@@ -52,6 +133,52 @@ inline marshall &operator<<(marshall &m, extent_protocol::attr a) {
     return m;
 }
 
+inline unmarshall &operator>>(unmarshall &u, extent_protocol::op &o) {
+    u >> o.code;
+    u >> o.id;
+    u >> o.type;
+    u >> o.data;
+    return u;
+}
+
+inline marshall &operator<<(marshall &m, const extent_protocol::op &o) {
+    m << o.code;
+    m << o.id;
+    m << o.type;
+    m << o.data;
+    return m;
+}
+
+inline unmarshall &operator>>(unmarshall &u, extent_protocol::result &r) {
+    u >> r.st;
+    u >> r.id;
+    u >> r.a;
+    u >> r.data;
+    return u;
+}
+
+inline marshall &operator<<(marshall &m, const extent_protocol::result &r) {
+    m << r.st;
+    m << r.id;
+    m << r.a;
+    m << r.data;
+    return m;
+}
+
+inline unmarshall &operator>>(unmarshall &u, extent_protocol::dirent &e) {
+    u >> e.name;
+    u >> e.id;
+    u >> e.a;
+    return u;
+}
+
+inline marshall &operator<<(marshall &m, const extent_protocol::dirent &e) {
+    m << e.name;
+    m << e.id;
+    m << e.a;
+    return m;
+}
+
 inline unmarshall &operator>>(unmarshall &u,
                               std::vector<extent_protocol::extentid_t> &vec) {
     unsigned size;
@@ -2,59 +2,208 @@
 
 #include "extent_server.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <sstream>
 
 #define PRE_ALLOC_NUM 128
 
-extent_server::extent_server() {
-    im = new inode_manager();
+// Directories indexed at most per shard, see dir_index_t
+#define DIR_INDEX_MAX 1024
+
+// Whether this thread is the worker of a shard, which runs every request
+// it is given itself, even one for the files of another shard.
+static thread_local bool on_worker = false;
+
+// On a worker, the latest commit the request it runs has to wait for,
+// which the RPC thread that queued it waits for instead, see run_on.
+static thread_local uint32_t *commit_seq = NULL;
+
+// At the top of a request on the files of shard key: run call there
+// instead, unless this is a worker already.
+#define ON_SHARD(key, call)                               \
+    do {                                                  \
+        if (workers && !on_worker)                        \
+            return run_on((key), [&]() { return (call); }); \
+    } while (0)
+
+// geo is only used if image has yet to be formatted. With nshards 0 every
+// request runs on the RPC thread that received it, as a single shard.
+extent_server::extent_server(const char *image, bool dedup,
+                             const geometry_t &geo, int nshards) {
+    im = new inode_manager(image, geo);
+    im->set_dedup(dedup);
+    snap = false;
+    pthread_mutex_init(&prealloc_lock, NULL);
+    init_shards(nshards > 0 ? nshards : 1, nshards > 0);
+}
+
+// A read-only server of the snapshot of live's files, e.g. for backups
+// while live keeps serving.
+extent_server::extent_server(extent_server *live) {
+    im = live->im;
+    snap = true;
+    pthread_mutex_init(&prealloc_lock, NULL);
+    init_shards(1, false);
 }
 
-int extent_server::create(uint32_t type, extent_protocol::extentid_t &id) {
-    id = im->alloc_inode(type);
+// Set up n shards, rounded down to a power of two no more than INODE_LOCKS
+// so that each has inode lock stripes of its own, and start their workers
+// if start.
+void extent_server::init_shards(uint32_t n, bool start) {
+    nshards = 1;
+    while (nshards * 2 <= n && nshards * 2 <= INODE_LOCKS) nshards *= 2;
+    workers = start;
+    shards = new shard_t[nshards];
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (uint32_t i = 0; i < nshards; i++) {
+        pthread_mutex_init(&shards[i].queue_lock, NULL);
+        pthread_cond_init(&shards[i].queue_cond, NULL);
+        pthread_mutex_init(&shards[i].dir_lock, NULL);
+        if (!start) continue;
+        pthread_t th;
+        if (pthread_create(&th, NULL, shard_worker, &shards[i]) != 0) {
+            printf("ERR! extent_server: cannot start shard %u\n", i);
+            exit(1);
+        }
+        pthread_detach(th);
+        if (ncpus > 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(i % ncpus, &cpus);
+            // a hint only, the worker runs on any core if it fails
+            pthread_setaffinity_np(th, sizeof(cpus), &cpus);
+        }
+    }
+}
+
+// Run the requests queued on shard arg, in order, forever.
+void *extent_server::shard_worker(void *arg) {
+    shard_t *s = (shard_t *)arg;
+    on_worker = true;
+    while (true) {
+        pthread_mutex_lock(&s->queue_lock);
+        while (s->queue.empty())
+            pthread_cond_wait(&s->queue_cond, &s->queue_lock);
+        std::packaged_task<int()> t = std::move(s->queue.front());
+        s->queue.pop_front();
+        pthread_mutex_unlock(&s->queue_lock);
+        t();
+    }
+    return NULL;
+}
+
+// Run fn on the worker of the shard of file id, and wait for its status,
+// then for the commit of its writes. The worker is on to the next request
+// of the shard meanwhile, whose commit may well be the same.
+int extent_server::run_on(extent_protocol::extentid_t id,
+                          const std::function<int()> &fn) {
+    shard_t &s = shard_of(id);
+    uint32_t seq = 0;
+    std::packaged_task<int()> t([&]() {
+        commit_seq = &seq;
+        int r = fn();
+        commit_seq = NULL;
+        return r;
+    });
+    std::future<int> done = t.get_future();
+    pthread_mutex_lock(&s.queue_lock);
+    s.queue.push_back(std::move(t));
+    pthread_cond_signal(&s.queue_cond);
+    pthread_mutex_unlock(&s.queue_lock);
+    int r = done.get();
+    im->wait_op(seq);
+    return r;
+}
+
+// Wait for the commit seq of a write, or on a worker leave it to run_on.
+void extent_server::commit(uint32_t seq) {
+    if (commit_seq)
+        *commit_seq = std::max(*commit_seq, seq);
+    else
+        im->wait_op(seq);
+}
+
+// Create a file of type in directory parent, 0 if unknown, which keeps it
+// in the allocation group of parent.
+int extent_server::create(uint32_t type, extent_protocol::extentid_t parent,
+                          extent_protocol::extentid_t &id) {
+    if (snap) return extent_protocol::IOERR;
+    ON_SHARD(parent, create(type, parent, id));
+    uint32_t seq = 0;
+    id = im->alloc_inode(type, parent & 0x7fffffff, &seq);
+    commit(seq);
     // printf("extent_server: create inode %llu\n", id);
 
     return extent_protocol::OK;
 }
 
 int extent_server::create_n_file(
-    int n, std::vector<extent_protocol::extentid_t> &vec) {
+    int n, extent_protocol::extentid_t parent,
+    std::vector<extent_protocol::extentid_t> &vec) {
+    if (snap) return extent_protocol::IOERR;
+    ON_SHARD(parent, create_n_file(n, parent, vec));
+    parent &= 0x7fffffff;
+    // the groups are shared by the parents of every shard
+    pthread_mutex_lock(&prealloc_lock);
+    auto &preallocated = this->preallocated[im->inode_group(parent)];
     size_t act_len =0; 
     if (preallocated.size() < (size_t)(n)) {
-        auto newVec = im->alloc_ninode(extent_protocol::T_FILE, 2 * n);
+        auto newVec =
+            im->alloc_ninode(extent_protocol::T_FILE, 2 * n, parent);
         act_len = newVec.size();
         preallocated.insert(preallocated.end(), newVec.begin(), newVec.end());
     }
     vec.insert(vec.begin(), preallocated.end() - act_len, preallocated.end());
     preallocated.erase(preallocated.end() - act_len, preallocated.end());
+    pthread_mutex_unlock(&prealloc_lock);
     return extent_protocol::OK;
 }
 
-int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &) {
+// The status of a write that returned r, see inode_manager::write_range.
+static int write_status(int r) {
+    if (r == -ENOSPC) return extent_protocol::NOSPC;
+    if (r == -EFBIG) return extent_protocol::FBIG;
+    return r < 0 ? extent_protocol::IOERR : extent_protocol::OK;
+}
+
+int extent_server::put(extent_protocol::extentid_t id, std::string buf,
+                       int &unused) {
     // printf(">extent_server: put %llu\n", id);
+    if (snap) return extent_protocol::IOERR;
+    ON_SHARD(id, put(id, buf, unused));
     id &= 0x7fffffff;
     const char *cbuf = buf.data();
     int size = (int)(buf.size());
-    im->write_file(id, cbuf, size);
+    uint32_t seq = 0;
+    int r = im->write_file(id, cbuf, size, &seq);
+    // after the write, so that no index of the old contents outlives it
+    drop_dir(id);
+    commit(seq);
     // printf("<extent_server: put inode=%llu, %u bytes\n", id, size);
-    return extent_protocol::OK;
+    return write_status(r);
 }
 
 int extent_server::get(extent_protocol::extentid_t id, std::string &buf) {
     // printf(">extent_server: get %llu\n", id);
+    ON_SHARD(id, get(id, buf));
     id &= 0x7fffffff;
 
     int size = 0;
     char *cbuf = NULL;
 
-    im->read_file(id, &cbuf, &size);
+    // a block that does not match its checksum fails the whole file
+    if (im->read_file(id, &cbuf, &size, snap) == -EIO)
+        return extent_protocol::IOERR;
     if (size == 0)
         buf = "";
     else {
@@ -67,27 +216,362 @@ int extent_server::get(extent_protocol::extentid_t id, std::string &buf) {
     return extent_protocol::OK;
 }
 
+// Read at most len bytes of file id at off, fewer past its end.
+int extent_server::read(extent_protocol::extentid_t id, uint32_t off,
+                        uint32_t len, std::string &buf) {
+    ON_SHARD(id, read(id, off, len, buf));
+    id &= 0x7fffffff;
+    extent_protocol::attr a;
+    memset(&a, 0, sizeof(a));
+    im->getattr(id, a, snap);
+    // only as much as there is is allocated, and read_range stops there
+    len = off < a.size ? std::min(len, a.size - off) : 0;
+    buf.resize(len);
+    int n = len ? im->read_range(id, off, len, &buf[0], snap) : 0;
+    if (n < 0) return extent_protocol::IOERR;
+    buf.resize(n);
+    return extent_protocol::OK;
+}
+
+// Write buf into file id at off, which grows it if they go past its end,
+// see inode_manager::write_range.
+int extent_server::write(extent_protocol::extentid_t id, uint32_t off,
+                         std::string buf, int &written) {
+    if (snap) return extent_protocol::IOERR;
+    ON_SHARD(id, write(id, off, buf, written));
+    id &= 0x7fffffff;
+    uint32_t seq = 0;
+    written = im->write_range(id, off, buf.data(), buf.size(), &seq);
+    drop_dir(id);
+    commit(seq);
+    return write_status(written);
+}
+
 int extent_server::getattr(extent_protocol::extentid_t id,
                            extent_protocol::attr &a) {
     // printf(">extent_server: getattr %lld\n", id);
+    ON_SHARD(id, getattr(id, a));
 
     id &= 0x7fffffff;
 
     extent_protocol::attr attr;
     memset(&attr, 0, sizeof(attr));
-    im->getattr(id, attr);
+    im->getattr(id, attr, snap);
     a = attr;
 
     // printf("<extent_server: getattr %lld\n", id);
     return extent_protocol::OK;
 }
 
-int extent_server::remove(extent_protocol::extentid_t id, int &) {
+int extent_server::remove(extent_protocol::extentid_t id, int &unused) {
     // printf(">extent_server: remove %lld\n", id);
 
+    if (snap) return extent_protocol::IOERR;
+    ON_SHARD(id, remove(id, unused));
     id &= 0x7fffffff;
-    im->remove_file(id);
+    uint32_t seq = 0;
+    im->remove_file(id, &seq);
+    drop_dir(id);
+    commit(seq);
 
     // printf("<extent_server: remove %lld\n", id);
     return extent_protocol::OK;
 }
+
+// Create a copy-on-write clone of file src, sharing its blocks.
+int extent_server::clone(extent_protocol::extentid_t src,
+                         extent_protocol::extentid_t &id) {
+    if (snap) return extent_protocol::IOERR;
+    ON_SHARD(src, clone(src, id));
+    src &= 0x7fffffff;
+    id = im->clone_file(src);
+    if (id == 0) return extent_protocol::IOERR;
+    return extent_protocol::OK;
+}
+
+// Take a snapshot of every file, see inode_manager::take_snapshot.
+int extent_server::snapshot(int, int &) {
+    if (snap || !im->take_snapshot()) return extent_protocol::IOERR;
+    return extent_protocol::OK;
+}
+
+int extent_server::drop_snapshot(int, int &) {
+    if (snap || !im->drop_snapshot()) return extent_protocol::IOERR;
+    return extent_protocol::OK;
+}
+
+// The number of inodes per allocation group, by which clients tell the
+// group of a file, see inode_manager::inode_group.
+int extent_server::inode_groups(int, int &ag_inodes) {
+    ag_inodes = im->group_inodes();
+    return extent_protocol::OK;
+}
+
+// Check the store on nthreads threads, and repair it unless repair is 0,
+// see inode_manager::fsck. A snapshot server only checks.
+int extent_server::fsck(int repair, int nthreads, int &problems) {
+    if (snap && repair) return extent_protocol::IOERR;
+    fsck_report_t r;
+    problems = im->fsck(repair, nthreads < 0 ? 0 : nthreads, r);
+    // a repair changes directories underneath their indexes
+    if (repair && problems > 0)
+        for (uint32_t i = 0; i < nshards; i++) {
+            pthread_mutex_lock(&shards[i].dir_lock);
+            shards[i].dirs.clear();
+            shards[i].dir_lru.clear();
+            pthread_mutex_unlock(&shards[i].dir_lock);
+        }
+    return extent_protocol::OK;
+}
+
+// Run ops in order, as if each was its own RPC, and return a result for
+// each up to the first that fails, which ends the request. They are not
+// atomic: the client holds the locks of the files it names. They run on
+// the shard of the first.
+int extent_server::compound(std::vector<extent_protocol::op> ops,
+                            std::vector<extent_protocol::result> &results) {
+    if (!ops.empty()) ON_SHARD(ops[0].id, compound(ops, results));
+    for (const extent_protocol::op &o : ops) {
+        extent_protocol::result r;
+        int unused;
+        switch (o.code) {
+            case extent_protocol::get:
+                r.st = get(o.id, r.data);
+                break;
+            case extent_protocol::getattr:
+                r.st = getattr(o.id, r.a);
+                break;
+            case extent_protocol::put:
+                r.st = put(o.id, o.data, unused);
+                break;
+            case extent_protocol::create:
+                r.st = create(o.type, o.id, r.id);
+                break;
+            case extent_protocol::remove:
+                r.st = remove(o.id, unused);
+                break;
+            default:
+                r.st = extent_protocol::IOERR;
+        }
+        results.push_back(r);
+        if (r.st != extent_protocol::OK) break;
+    }
+    return extent_protocol::OK;
+}
+
+// Read directory dir and index it into d. Return false if dir is not one
+// or cannot be read.
+bool extent_server::load_dir(extent_protocol::extentid_t dir,
+                             dir_index_t &d) {
+    extent_protocol::attr a;
+    memset(&a, 0, sizeof(a));
+    im->getattr(dir, a, snap);
+    if (a.type != extent_protocol::T_DIR) return false;
+    char *cbuf = NULL;
+    int size = 0;
+    if (im->read_file(dir, &cbuf, &size, snap) < 0) return false;
+    d.data.assign(cbuf ? cbuf : "", size);
+    free(cbuf);
+    d.entries.clear();
+    d.dead = d.data.size();
+    dir_for_each(d.data, [&](const std::string &name,
+                             extent_protocol::extentid_t inum, size_t off,
+                             size_t len) {
+        d.entries[name] = {inum, (uint32_t)off};
+        d.dead -= len;
+        return true;
+    });
+    return true;
+}
+
+// The index of directory dir, loaded if need be, NULL if dir is not one.
+// The least recently used index goes to make room for a new one. s is the
+// shard of dir, and caller holds its dir_lock.
+extent_server::dir_index_t *extent_server::index_dir(
+    shard_t &s, extent_protocol::extentid_t dir) {
+    auto it = s.dirs.find(dir);
+    if (it != s.dirs.end()) {
+        s.dir_lru.splice(s.dir_lru.begin(), s.dir_lru, it->second.pos);
+        return &it->second;
+    }
+    dir_index_t d;
+    if (!load_dir(dir, d)) return NULL;
+    if (s.dirs.size() >= DIR_INDEX_MAX) forget_dir(s, s.dir_lru.back());
+    s.dir_lru.push_front(dir);
+    d.pos = s.dir_lru.begin();
+    return &(s.dirs[dir] = std::move(d));
+}
+
+// Forget the index of dir, if any. Caller holds the dir_lock of s, the
+// shard of dir.
+void extent_server::forget_dir(shard_t &s, extent_protocol::extentid_t dir) {
+    auto it = s.dirs.find(dir);
+    if (it == s.dirs.end()) return;
+    s.dir_lru.erase(it->second.pos);
+    s.dirs.erase(it);
+}
+
+// Forget the index of dir, which is changed by other means.
+void extent_server::drop_dir(extent_protocol::extentid_t dir) {
+    shard_t &s = shard_of(dir);
+    pthread_mutex_lock(&s.dir_lock);
+    forget_dir(s, dir);
+    pthread_mutex_unlock(&s.dir_lock);
+}
+
+// Find the file named name in directory dir: NOENT if there is none,
+// IOERR if dir is not a directory.
+int extent_server::dir_lookup(extent_protocol::extentid_t dir,
+                              std::string name,
+                              extent_protocol::extentid_t &id) {
+    ON_SHARD(dir, dir_lookup(dir, name, id));
+    dir &= 0x7fffffff;
+    if (snap) {
+        // the snapshot changes under a server of its own, so is not indexed
+        dir_index_t d;
+        if (!load_dir(dir, d)) return extent_protocol::IOERR;
+        auto e = d.entries.find(name);
+        if (e == d.entries.end()) return extent_protocol::NOENT;
+        id = e->second.first;
+        return extent_protocol::OK;
+    }
+    int ret = extent_protocol::OK;
+    shard_t &s = shard_of(dir);
+    pthread_mutex_lock(&s.dir_lock);
+    dir_index_t *d = index_dir(s, dir);
+    if (d == NULL) {
+        ret = extent_protocol::IOERR;
+    } else {
+        auto e = d->entries.find(name);
+        if (e == d->entries.end())
+            ret = extent_protocol::NOENT;
+        else
+            id = e->second.first;
+    }
+    pthread_mutex_unlock(&s.dir_lock);
+    return ret;
+}
+
+// Add an entry for file id named name to directory dir, appended in place:
+// EXIST if there is one by that name already. The commit is waited for
+// once the directory is unlocked.
+int extent_server::dir_add(extent_protocol::extentid_t dir, std::string name,
+                           extent_protocol::extentid_t id, int &unused) {
+    if (snap || name.empty() || name.find('/') != std::string::npos)
+        return extent_protocol::IOERR;
+    ON_SHARD(dir, dir_add(dir, name, id, unused));
+    dir &= 0x7fffffff;
+    int ret = extent_protocol::OK;
+    uint32_t seq = 0;
+    shard_t &s = shard_of(dir);
+    pthread_mutex_lock(&s.dir_lock);
+    dir_index_t *d = index_dir(s, dir);
+    if (d == NULL) {
+        ret = extent_protocol::IOERR;
+    } else if (d->entries.count(name)) {
+        ret = extent_protocol::EXIST;
+    } else {
+        std::string ent = dir_entry(name, id);
+        uint32_t off = d->data.size();
+        int r = im->write_range(dir, off, ent.data(), ent.size(), &seq);
+        if (r < 0) {
+            forget_dir(s, dir);
+            ret = write_status(r);
+        } else {
+            d->data += ent;
+            d->entries[name] = {id, off};
+        }
+    }
+    pthread_mutex_unlock(&s.dir_lock);
+    commit(seq);
+    return ret;
+}
+
+// Remove the entry named name from directory dir, and return the file it
+// named in id: NOENT if there is none. The entry is overwritten in place by
+// a tombstone, and the directory written out again without them once they
+// are half of it. The commit is waited for once the directory is unlocked.
+int extent_server::dir_remove(extent_protocol::extentid_t dir,
+                              std::string name,
+                              extent_protocol::extentid_t &id) {
+    if (snap) return extent_protocol::IOERR;
+    ON_SHARD(dir, dir_remove(dir, name, id));
+    dir &= 0x7fffffff;
+    int ret = extent_protocol::OK;
+    uint32_t seq = 0;
+    shard_t &s = shard_of(dir);
+    pthread_mutex_lock(&s.dir_lock);
+    dir_index_t *d = index_dir(s, dir);
+    if (d == NULL) {
+        pthread_mutex_unlock(&s.dir_lock);
+        return extent_protocol::IOERR;
+    }
+    auto e = d->entries.find(name);
+    if (e == d->entries.end()) {
+        ret = extent_protocol::NOENT;
+    } else {
+        id = e->second.first;
+        uint32_t off = e->second.second;
+        uint32_t len = dir_entry(name, id).size();
+        std::string tomb = dir_tombstone(len);
+        d->entries.erase(e);
+        d->data.replace(off, len, tomb);
+        d->dead += len;
+        int r;
+        if (d->dead * 2 > d->data.size()) {
+            d->data = dir_compact(d->data);
+            d->dead = 0;
+            dir_for_each(d->data, [&](const std::string &n,
+                                      extent_protocol::extentid_t,
+                                      size_t o, size_t) {
+                d->entries[n].second = o;
+                return true;
+            });
+            r = im->write_file(dir, d->data.data(), d->data.size(), &seq);
+        } else {
+            r = im->write_range(dir, off, tomb.data(), len, &seq);
+        }
+        if (r < 0) {
+            forget_dir(s, dir);
+            ret = write_status(r);
+        }
+    }
+    pthread_mutex_unlock(&s.dir_lock);
+    commit(seq);
+    return ret;
+}
+
+// List directory dir, in order, with the attributes of every file in it,
+// so that a listing costs the client one round trip.
+int extent_server::readdirplus(extent_protocol::extentid_t dir,
+                               std::vector<extent_protocol::dirent> &ents) {
+    ON_SHARD(dir, readdirplus(dir, ents));
+    dir &= 0x7fffffff;
+    dir_index_t copy;
+    if (snap) {
+        if (!load_dir(dir, copy)) return extent_protocol::IOERR;
+    } else {
+        shard_t &s = shard_of(dir);
+        pthread_mutex_lock(&s.dir_lock);
+        const dir_index_t *i = index_dir(s, dir);
+        if (i) copy.data = i->data;
+        pthread_mutex_unlock(&s.dir_lock);
+        if (i == NULL) return extent_protocol::IOERR;
+    }
+    dir_for_each(copy.data, [&](const std::string &name,
+                                extent_protocol::extentid_t inum, size_t,
+                                size_t) {
+        extent_protocol::dirent e;
+        e.name = name;
+        e.id = inum;
+        memset(&e.a, 0, sizeof(e.a));
+        im->getattr(inum & 0x7fffffff, e.a, snap);
+        ents.push_back(e);
+        return true;
+    });
+    return extent_protocol::OK;
+}
+
+void extent_server::sync() {
+    im->sync();
+}
@@ -3,8 +3,15 @@
 #ifndef extent_server_h
 #define extent_server_h
 
+#include <pthread.h>
+
+#include <deque>
+#include <functional>
+#include <future>
+#include <list>
 #include <map>
 #include <string>
+#include <unordered_map>
 
 #include "extent_protocol.h"
 #include "inode_manager.h"
@@ -19,20 +26,96 @@ class extent_server {
   std::map <extent_protocol::extentid_t, extent_t> extents;
 #endif
     inode_manager *im;
+    bool snap;  // serves the snapshot of im, read-only
 
    public:
-    extent_server();
+    extent_server(const char *image = NULL, bool dedup = false,
+                  const geometry_t &geo = geometry_t(), int nshards = 0);
+    extent_server(extent_server *live);
 
-    int create(uint32_t type, extent_protocol::extentid_t &id);
-    int create_n_file(int n, std::vector<extent_protocol::extentid_t> &vec);
+    int create(uint32_t type, extent_protocol::extentid_t parent,
+               extent_protocol::extentid_t &id);
+    int create_n_file(int n, extent_protocol::extentid_t parent,
+                      std::vector<extent_protocol::extentid_t> &vec);
     int put(extent_protocol::extentid_t id, std::string, int &);
     int get(extent_protocol::extentid_t id, std::string &);
+    int read(extent_protocol::extentid_t id, uint32_t off, uint32_t len,
+             std::string &buf);
+    int write(extent_protocol::extentid_t id, uint32_t off, std::string buf,
+              int &written);
     int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
     int remove(extent_protocol::extentid_t id, int &);
+    int clone(extent_protocol::extentid_t src,
+              extent_protocol::extentid_t &id);
+    int snapshot(int, int &);
+    int drop_snapshot(int, int &);
+    int fsck(int repair, int nthreads, int &problems);
+    int inode_groups(int, int &ag_inodes);
+    int compound(std::vector<extent_protocol::op> ops,
+                 std::vector<extent_protocol::result> &results);
+    int dir_lookup(extent_protocol::extentid_t dir, std::string name,
+                   extent_protocol::extentid_t &id);
+    int dir_add(extent_protocol::extentid_t dir, std::string name,
+                extent_protocol::extentid_t id, int &);
+    int dir_remove(extent_protocol::extentid_t dir, std::string name,
+                   extent_protocol::extentid_t &id);
+    int readdirplus(extent_protocol::extentid_t dir,
+                    std::vector<extent_protocol::dirent> &ents);
+    void sync();
+    // shards with a worker thread, 0 if requests run on the RPC threads
+    uint32_t shard_workers() const {
+        return workers ? nshards : 0;
+    }
 
    private:
-    // only preallocate FILE inodes, NOT DIR/LINK
-    std::vector<extent_protocol::extentid_t> preallocated;
+    // only preallocate FILE inodes, NOT DIR/LINK, per allocation group
+    std::vector<extent_protocol::extentid_t> preallocated[AG_COUNT];
+    pthread_mutex_t prealloc_lock;  // guards preallocated
+
+    // A directory indexed by name, to the inum and offset of its entry,
+    // along with its contents as stored, dead bytes of them tombstones
+    // (see dir_tombstone), and where it is in the LRU list of its shard.
+    typedef struct dir_index {
+        std::string data;
+        std::unordered_map<std::string,
+                           std::pair<extent_protocol::extentid_t, uint32_t>>
+            entries;
+        uint32_t dead;
+        std::list<extent_protocol::extentid_t>::iterator pos;
+    } dir_index_t;
+
+    // The files are split into shards by inum, shard i taking those equal
+    // to i modulo nshards, and so the inode lock stripes equal to i (see
+    // INODE_LOCKS). The requests on the files of a shard run in order on
+    // a worker thread of its own, pinned to a core, so that a slow request
+    // holds up its shard only. The commits are waited for by the RPC
+    // threads, not the workers, see run_on. A shard also keeps the index
+    // of its directories.
+    typedef struct shard {
+        pthread_mutex_t queue_lock;  // guards queue
+        pthread_cond_t queue_cond;
+        std::deque<std::packaged_task<int()>> queue;
+        // the directories indexed so far, up to DIR_INDEX_MAX of them,
+        // which any other change to one drops
+        std::unordered_map<extent_protocol::extentid_t, dir_index_t> dirs;
+        std::list<extent_protocol::extentid_t> dir_lru;  // most recent first
+        pthread_mutex_t dir_lock;  // guards dirs and dir_lru
+    } shard_t;
+    shard_t *shards;
+    uint32_t nshards;  // at least 1
+    bool workers;      // whether the shards have worker threads
+    void init_shards(uint32_t n, bool start);
+    shard_t &shard_of(extent_protocol::extentid_t id) {
+        return shards[(id & 0x7fffffff) % nshards];
+    }
+    int run_on(extent_protocol::extentid_t id, const std::function<int()> &fn);
+    void commit(uint32_t seq);
+    static void *shard_worker(void *arg);
+
+    bool load_dir(extent_protocol::extentid_t dir, dir_index_t &d);
+    dir_index_t *index_dir(shard_t &s, extent_protocol::extentid_t dir);
+    void forget_dir(shard_t &s, extent_protocol::extentid_t dir);
+    void drop_dir(extent_protocol::extentid_t dir);
 };
 
 #endif
@@ -1,10 +1,48 @@
 #include "rpc.h"
 #include <arpa/inet.h>
+#include <signal.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
+#include <algorithm>
+#include <string>
 #include "extent_server.h"
 
+// Seconds between two durability barriers of a file-backed disk
+#define SYNC_INTERVAL 5
+
+static volatile sig_atomic_t stopping = 0;
+
+static void
+on_stop(int)
+{
+  stopping = 1;
+}
+
+static void
+reg_all(rpcs &server, extent_server &ls)
+{
+  server.reg(extent_protocol::get, &ls, &extent_server::get);
+  server.reg(extent_protocol::getattr, &ls, &extent_server::getattr);
+  server.reg(extent_protocol::put, &ls, &extent_server::put);
+  server.reg(extent_protocol::remove, &ls, &extent_server::remove);
+  server.reg(extent_protocol::create, &ls, &extent_server::create);
+  server.reg(extent_protocol::create_n_file, &ls, &extent_server::create_n_file);
+  server.reg(extent_protocol::clone, &ls, &extent_server::clone);
+  server.reg(extent_protocol::snapshot, &ls, &extent_server::snapshot);
+  server.reg(extent_protocol::drop_snapshot, &ls, &extent_server::drop_snapshot);
+  server.reg(extent_protocol::fsck, &ls, &extent_server::fsck);
+  server.reg(extent_protocol::read, &ls, &extent_server::read);
+  server.reg(extent_protocol::write, &ls, &extent_server::write);
+  server.reg(extent_protocol::compound, &ls, &extent_server::compound);
+  server.reg(extent_protocol::dir_lookup, &ls, &extent_server::dir_lookup);
+  server.reg(extent_protocol::dir_add, &ls, &extent_server::dir_add);
+  server.reg(extent_protocol::dir_remove, &ls, &extent_server::dir_remove);
+  server.reg(extent_protocol::readdirplus, &ls, &extent_server::readdirplus);
+  server.reg(extent_protocol::inode_groups, &ls, &extent_server::inode_groups);
+}
+
 // Main loop of extent server
 
 int
@@ -24,15 +62,77 @@ main(int argc, char *argv[])
     count = atoi(count_env);
   }
 
-  rpcs server(atoi(argv[1]), count);
-  extent_server ls;
+  // Keep the extents in an image file (survives restarts) if one is given
+  char *image = getenv("EXTENT_IMAGE");
+  // Start the image over, whatever it holds; without this only a missing
+  // or empty image gets formatted
+  if(image != NULL && getenv("EXTENT_FORMAT") != NULL){
+    std::string journal = std::string(image) + ".journal";
+    if((truncate(image, 0) < 0 && errno != ENOENT) ||
+       (truncate(journal.c_str(), 0) < 0 && errno != ENOENT)){
+      perror("extent_server: truncate image");
+      exit(1);
+    }
+  }
+  // Share the blocks of identical data between files
+  bool dedup = getenv("EXTENT_DEDUP") != NULL;
+
+  // Geometry of a new image, or of the in-memory disk; an existing image
+  // keeps its own, and one it does not have is refused rather than
+  // ignored
+  geometry_t geo;
+  char *bs_env = getenv("EXTENT_BLOCK_SIZE");
+  char *size_env = getenv("EXTENT_DISK_SIZE");
+  char *inodes_env = getenv("EXTENT_INODES");
+  if(bs_env != NULL || size_env != NULL || inodes_env != NULL){
+    uint32_t bs = bs_env ? atoi(bs_env) : BLOCK_SIZE;
+    uint64_t size = size_env ? strtoull(size_env, NULL, 0) : DISK_SIZE;
+    uint32_t ninodes = inodes_env ? atoi(inodes_env) : INODE_NUM;
+    geo = geometry_t(bs, bs ? size / bs : 0, ninodes);
+    geometry_t found;
+    if(image != NULL && probe_geometry(image, found) &&
+       (found.block_size != geo.block_size || found.nblocks != geo.nblocks ||
+        found.ninodes != geo.ninodes)){
+      fprintf(stderr, "extent_server: %s has %u blocks of %u bytes and %u "
+              "inodes, not %u of %u and %u; set EXTENT_FORMAT to start it "
+              "over\n", image, found.nblocks, found.block_size,
+              found.ninodes, geo.nblocks, geo.block_size, geo.ninodes);
+      exit(1);
+    }
+  }
 
-  server.reg(extent_protocol::get, &ls, &extent_server::get);
-  server.reg(extent_protocol::getattr, &ls, &extent_server::getattr);
-  server.reg(extent_protocol::put, &ls, &extent_server::put);
-  server.reg(extent_protocol::remove, &ls, &extent_server::remove);
-  server.reg(extent_protocol::create, &ls, &extent_server::create);
-  server.reg(extent_protocol::create_n_file, &ls, &extent_server::create_n_file);
-  while(1)
-    sleep(1000);
+  // Shards of the files, each with a worker thread, one per core by
+  // default; 0 runs every request on the RPC thread that received it, as
+  // on a single core, where one worker would only serialize the requests
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int nshards = ncpus > 1 ? ncpus : 0;
+  char *shards_env = getenv("EXTENT_SHARDS");
+  if(shards_env != NULL){
+    nshards = atoi(shards_env);
+  }
+
+  // Serve the snapshot read-only on this port too, for backups
+  char *snap_port = getenv("EXTENT_SNAPSHOT_PORT");
+
+  // enough RPC threads to keep every shard busy while others wait on
+  // theirs, counting the shards the server actually set up
+  extent_server ls(image, dedup, geo, nshards);
+  rpcs server(atoi(argv[1]), count, std::max(10, 4 * (int)ls.shard_workers()));
+  reg_all(server, ls);
+
+  rpcs *snap_server = NULL;
+  extent_server *snap = NULL;
+  if(snap_port != NULL){
+    snap_server = new rpcs(atoi(snap_port), count);
+    snap = new extent_server(&ls);
+    reg_all(*snap_server, *snap);
+  }
+
+  signal(SIGTERM, on_stop);
+  signal(SIGINT, on_stop);
+  while(!stopping){
+    sleep(SYNC_INTERVAL);
+    ls.sync();
+  }
+  exit(0);
 }
@@ -179,6 +179,8 @@ void fuseserver_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
     int r;
     if ((r = yfs->read(ino, size, off, buf)) == yfs_client::OK) {
         fuse_reply_buf(req, buf.c_str(), buf.size());
+    } else if (r == yfs_client::IOERR) {
+        fuse_reply_err(req, EIO);
     } else {
         fuse_reply_err(req, ENOENT);
     }
@@ -212,6 +214,10 @@ void fuseserver_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
         fuse_reply_write(req, size);
         // std::cout << "[FUSE] [W] OK. expect " << exp_size << " got " << size
         // << "\n";
+    } else if (r == yfs_client::FBIG) {
+        fuse_reply_err(req, EFBIG);
+    } else if (r == yfs_client::NOSPC) {
+        fuse_reply_err(req, ENOSPC);
     } else {
         fuse_reply_err(req, ENOENT);
     }
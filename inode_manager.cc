@@ -1,454 +1,3241 @@
 #include "inode_manager.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <math.h>
 #include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <climits>
 #include <cstring>
 #include <ctime>
+#include <string>
+#include <thread>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 // disk layer -----------------------------------------
 
-disk::disk() {
-    bzero(blocks, sizeof(blocks));
+static std::array<uint32_t, 256> crc32c_make_table() {
+    std::array<uint32_t, 256> t;
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+        t[i] = c;
+    }
+    return t;
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+    static const std::array<uint32_t, 256> table = crc32c_make_table();
+    while (len--) crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
 }
 
-inline void disk::read_block(blockid_t id, char *buf) {
-    // if (id < 0 || id >= BLOCK_NUM || buf == NULL) return;
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hw(
+    uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t c = crc;
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c = _mm_crc32_u64(c, w);
+    }
+    crc = c;
+    while (len--) crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+// Uses the SSE4.2 crc32 instruction when the CPU has it.
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = (const unsigned char *)buf;
+#if defined(__x86_64__)
+    static const bool hw = __builtin_cpu_supports("sse4.2");
+    if (hw) return ~crc32c_hw(~crc, p, len);
+#endif
+    return ~crc32c_sw(~crc, p, len);
+}
+
+// Anonymous pages are zero-filled on first touch, no need to clear them.
+disk::disk(uint32_t block_size, uint32_t nblocks)
+    : block_size(block_size),
+      nblocks(nblocks),
+      fd(-1),
+      crc_fd(-1),
+      image_ino(0) {
+    blocks = (unsigned char *)mmap(NULL, (size_t)nblocks * block_size,
+                                   PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                   -1, 0);
+    if (blocks == MAP_FAILED) {
+        perror("disk: mmap");
+        exit(1);
+    }
+    char zero[BLOCK_SIZE_MAX] = {0};
+    crcs.assign(nblocks, crc32c(0, zero, block_size));
+    checked.assign((nblocks + 63) / 64, 0);
+    pthread_rwlock_init(&crc_lock, NULL);
+}
+
+// Map an image file, growing it (sparsely) to nblocks if it is shorter.
+disk::disk(const char *image, uint32_t block_size, uint32_t nblocks)
+    : block_size(block_size), nblocks(nblocks) {
+    size_t len = (size_t)nblocks * block_size;
+    struct stat st;
+    fd = open(image, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("disk: open image");
+        exit(1);
+    }
+    // one process at a time: an extent_server, or yfs_fsck offline. The
+    // lock is the process's, so a process can mount an image again
+    struct flock fl = {};
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    if (fcntl(fd, F_SETLK, &fl) < 0) {
+        fprintf(stderr, "disk: %s is in use by another process\n", image);
+        exit(1);
+    }
+    bool fresh = (size_t)st.st_size < len;
+    image_ino = st.st_ino;
+    if (fresh && ftruncate(fd, len) < 0) {
+        perror("disk: ftruncate image");
+        exit(1);
+    }
+    blocks = (unsigned char *)mmap(NULL, len, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED, fd, 0);
+    if (blocks == MAP_FAILED) {
+        perror("disk: mmap image");
+        exit(1);
+    }
+    checked.assign((nblocks + 63) / 64, 0);
+    pthread_rwlock_init(&crc_lock, NULL);
+    load_crcs((std::string(image) + ".crc").c_str(), fresh);
+}
+
+disk::~disk() {
+    sync();
+    munmap(blocks, (size_t)nblocks * block_size);
+    if (fd >= 0) close(fd);
+    if (crc_fd >= 0) close(crc_fd);
+}
+
+// Load the checksums of an image as of its last sync, which the journal
+// then brings up to date, see journal::replay. They are only computed from
+// its contents if the checksum file is missing or belongs to another image.
+void disk::load_crcs(const char *path, bool fresh) {
+    crcs.resize(nblocks);
+    crc_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (crc_fd < 0) {
+        perror("disk: open checksums");
+        exit(1);
+    }
+    crc_header_t h;
+    size_t len = (size_t)nblocks * sizeof(uint32_t);
+    if (!fresh && pread(crc_fd, &h, sizeof(h), 0) == sizeof(h) &&
+        h.magic == CRC_MAGIC && h.nblocks == nblocks && h.clean &&
+        h.image_ino == image_ino &&
+        pread(crc_fd, crcs.data(), len, sizeof(h)) == (ssize_t)len)
+        return;
+    printf("\tdisk: rebuilding block checksums\n");
+    with_block_size(block_size, [&](auto bs) {
+        for (uint32_t i = 0; i < nblocks; i++)
+            crcs[i] = crc32c(0, blocks + (size_t)i * bs, bs);
+    });
+}
+
+// Every write to an image holds crc_lock shared, so that sync saves the
+// checksums of what it flushed.
+void disk::begin_write() {
+    if (crc_fd >= 0) pthread_rwlock_rdlock(&crc_lock);
+}
 
-    memcpy(buf, blocks[id], BLOCK_SIZE);
+void disk::end_write() {
+    if (crc_fd >= 0) pthread_rwlock_unlock(&crc_lock);
+}
+
+// Single blocks are copied through with_block_size.
+inline void disk::read_block(blockid_t id, char *buf) {
+    with_block_size(block_size, [&](auto bs) {
+        memcpy(buf, blocks + (size_t)id * bs, bs);
+    });
 }
 
 inline void disk::write_block(blockid_t id, const char *buf) {
-    // if (id < 0 || id >= BLOCK_NUM || buf == NULL) return;
+    begin_write();
+    with_block_size(block_size, [&](auto bs) {
+        memcpy(blocks + (size_t)id * bs, buf, bs);
+        crcs[id] = crc32c(0, buf, bs);
+    });
+    __atomic_fetch_and(&checked[id / 64], ~(1ULL << (id % 64)),
+                       __ATOMIC_RELAXED);
+    end_write();
+}
 
-    memcpy(blocks[id], buf, BLOCK_SIZE);
+inline void disk::read_blocks(blockid_t id, uint32_t n, char *buf) {
+    memcpy(buf, blocks + (size_t)id * block_size, (size_t)n * block_size);
 }
 
-// block layer -----------------------------------------
+inline void disk::write_blocks(blockid_t id, uint32_t n, const char *buf) {
+    begin_write();
+    memcpy(blocks + (size_t)id * block_size, buf, (size_t)n * block_size);
+    with_block_size(block_size, [&](auto bs) {
+        for (uint32_t i = 0; i < n; i++)
+            crcs[id + i] = crc32c(0, buf + (size_t)i * bs, bs);
+    });
+    for (uint32_t b = id; b < id + n; b++)
+        __atomic_fetch_and(&checked[b / 64], ~(1ULL << (b % 64)),
+                           __ATOMIC_RELAXED);
+    end_write();
+}
 
-// Allocate a free disk block.
-blockid_t block_manager::alloc_block() {
-    /*
-     * you should mark the corresponding bit in block bitmap when alloc.
-     * you need to think about which block you can start to be allocated.
-     */
-    // iterate throught the bit map to find a free block
-    // uint32_t bitmap_blocks = BLOCK_NUM / BPB;
-    // uint32_t inode_table_blocks = INODE_NUM / IPB;
-    // uint32_t reserved = 2 + bitmap_blocks + inode_table_blocks;
-    const uint32_t reserved = 2 + BLOCK_NUM / BPB + INODE_NUM / IPB;
-    blockid_t free_block_id = BLOCK_NUM;
-    pthread_mutex_lock(&lock);
-    std::vector<int>::iterator end = using_blocks.end();
-    std::vector<int>::iterator it = using_blocks.begin();
-    std::advance(it, reserved);
-    for (; it != end; it++) {
-        if (*it == 0) {
-            *it = 1;
-            pthread_mutex_unlock(&lock);
-            return it - using_blocks.begin();
+// Check buf, just read from block id, against the checksum of the block.
+bool disk::verify(blockid_t id, const char *buf) const {
+    return crc32c(0, buf, block_size) == crcs[id];
+}
+
+// Set the checksum of block id, as it was when journaled.
+void disk::set_crc(blockid_t id, uint32_t crc) {
+    crcs[id] = crc;
+    __atomic_fetch_and(&checked[id / 64], ~(1ULL << (id % 64)),
+                       __ATOMIC_RELAXED);
+}
+
+// Make blocks [id, id + n) of an image durable in place.
+void disk::flush(blockid_t id, uint32_t n) {
+    if (fd < 0) return;
+    static const size_t page = sysconf(_SC_PAGESIZE);
+    size_t begin = (size_t)id * block_size / page * page;
+    size_t end = (size_t)(id + n) * block_size;
+    if (msync(blocks + begin, end - begin, MS_SYNC) < 0)
+        perror("disk: flush");
+}
+
+// Durability barrier: flush dirty pages of the image and its metadata, then
+// save the checksums of what was flushed.
+void disk::sync() {
+    if (fd < 0) return;
+    pthread_rwlock_wrlock(&crc_lock);
+    msync(blocks, (size_t)nblocks * block_size, MS_SYNC);
+    fdatasync(fd);
+    crc_header_t h = {CRC_MAGIC, nblocks, 1, image_ino};
+    size_t len = (size_t)nblocks * sizeof(uint32_t);
+    if (pwrite(crc_fd, crcs.data(), len, sizeof(h)) != (ssize_t)len ||
+        pwrite(crc_fd, &h, sizeof(h), 0) != sizeof(h) ||
+        fdatasync(crc_fd) < 0)
+        perror("disk: save checksums");
+    pthread_rwlock_unlock(&crc_lock);
+}
+
+// log layer -----------------------------------------
+
+// FNV-1a, only used to tell a complete transaction from a torn one
+static uint32_t journal_checksum(const char *buf, size_t len,
+                                 uint32_t h = 2166136261u) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)buf[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Bytes taken by the header and the id lists of transaction h, padded to a
+// block of bs bytes
+static size_t journal_ids_size(const journal_header_t &h, uint32_t bs) {
+    size_t len = sizeof(h) + ((size_t)h.nblocks + h.nrevoked +
+                              2 * (size_t)h.ncrcs) * sizeof(blockid_t);
+    return (len + bs - 1) / bs * bs;
+}
+
+journal::journal(disk *d, const char *path)
+    : d(d),
+      tail(0),
+      seq(1),
+      committed(0),
+      outstanding(0),
+      committing(false),
+      want_commit(false) {
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror("journal: open");
+        exit(1);
+    }
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+    replay();
+}
+
+// Whatever was committed is in the journal file, replayed at the next mount
+// unless a checkpoint emptied it.
+journal::~journal() {
+    close(fd);
+    pthread_mutex_destroy(&lock);
+    pthread_cond_destroy(&cond);
+}
+
+// Install every complete transaction of the journal file on the disk, then
+// start over with an empty journal.
+void journal::replay() {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) return;
+    std::vector<char> log(st.st_size);
+    if (pread(fd, log.data(), log.size(), 0) != (ssize_t)log.size()) {
+        perror("journal: read");
+        exit(1);
+    }
+    // find the complete transactions, and for every block the last one
+    // that revoked it
+    std::vector<size_t> txns;
+    std::map<blockid_t, size_t> last_revoke;
+    uint32_t bs = d->bsize();
+    size_t off = 0;
+    while (off + sizeof(journal_header_t) <= log.size()) {
+        journal_header_t h;
+        memcpy(&h, &log[off], sizeof(h));
+        if (h.magic != JOURNAL_MAGIC) break;
+        size_t ids = journal_ids_size(h, bs);
+        size_t data = (size_t)h.nblocks * bs;
+        if (off + ids + data + sizeof(h) > log.size()) break;
+        journal_header_t c;
+        memcpy(&c, &log[off + ids + data], sizeof(c));
+        uint32_t sum = journal_checksum(&log[off + sizeof(h)],
+                                        ids + data - sizeof(h));
+        if (c.magic != JOURNAL_COMMIT || c.seq != h.seq || sum != h.checksum)
+            break;
+        const blockid_t *id = (const blockid_t *)&log[off + sizeof(h)];
+        for (uint32_t i = 0; i < h.nrevoked; i++)
+            last_revoke[id[h.nblocks + i]] = txns.size();
+        txns.push_back(off);
+        off += ids + data + bs;
+    }
+    for (size_t t = 0; t < txns.size(); t++) {
+        journal_header_t h;
+        memcpy(&h, &log[txns[t]], sizeof(h));
+        const blockid_t *id = (const blockid_t *)&log[txns[t] + sizeof(h)];
+        const char *data = &log[txns[t] + journal_ids_size(h, bs)];
+        // the data blocks were flushed before the commit, see commit
+        const uint32_t *crc = id + h.nblocks + h.nrevoked;
+        for (uint32_t i = 0; i < h.ncrcs; i++)
+            d->set_crc(crc[2 * i], crc[2 * i + 1]);
+        for (uint32_t i = 0; i < h.nblocks; i++) {
+            auto r = last_revoke.find(id[i]);
+            if (r != last_revoke.end() && r->second >= t) continue;
+            d->write_block(id[i], data + (size_t)i * bs);
         }
     }
-    pthread_mutex_unlock(&lock);
-    return free_block_id;
+    printf("\tjournal: replayed %zu transactions\n", txns.size());
+    d->sync();
+    if (ftruncate(fd, 0) < 0 || fdatasync(fd) < 0) perror("journal: reset");
 }
 
-void block_manager::free_block(uint32_t id) {
-    /*
-     * your code goes here.
-     * note: you should unmark the corresponding bit in the block bitmap when
-     * free.
-     */
+// Join the transaction being built, unless a commit is on its way.
+void journal::begin_op() {
     pthread_mutex_lock(&lock);
-    using_blocks[id] = 0;
+    while (committing || want_commit) pthread_cond_wait(&cond, &lock);
+    outstanding++;
     pthread_mutex_unlock(&lock);
-    return;
 }
 
-// The layout of disk should be like this:
-// |<-sb->|<-free block bitmap->|<-inode table->|<-data->|
-block_manager::block_manager() {
-    d = new disk();
+// Leave the transaction, return its seq to wait() on for durability. Call it
+// before releasing the locks the operation took, and wait() after.
+uint32_t journal::end_op() {
+    pthread_mutex_lock(&lock);
+    uint32_t s = seq;
+    outstanding--;
+    if (outstanding == 0) pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    return s;
+}
 
-    // format the disk
-    sb.size = BLOCK_SIZE * BLOCK_NUM;
-    sb.nblocks = BLOCK_NUM;
-    sb.ninodes = INODE_NUM;
+// Block until transaction s is in the journal. The last operation of a
+// transaction to get here commits it for everybody.
+void journal::wait(uint32_t s) {
+    pthread_mutex_lock(&lock);
+    while (committed < s) {
+        if (!committing && outstanding == 0) {
+            commit();
+        } else {
+            if (!committing) want_commit = true;
+            pthread_cond_wait(&cond, &lock);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
 
-    // init free block map
-    using_blocks = std::vector<int>(BLOCK_NUM, 0);
+// Write the transaction being built to the journal and install its blocks.
+// Called with the lock held and no operation outstanding.
+void journal::commit() {
+    committing = true;
+    want_commit = false;
+    uint32_t s = seq;
+    if (!pending.empty() || !revoked.empty() || !crcs.empty()) {
+        journal_header_t h;
+        h.magic = JOURNAL_MAGIC;
+        h.seq = s;
+        h.nblocks = pending.size();
+        h.nrevoked = revoked.size();
+        h.ncrcs = crcs.size();
+        uint32_t bs = d->bsize();
+        size_t ids = journal_ids_size(h, bs);
+        std::vector<char> txn(ids + (size_t)h.nblocks * bs + bs);
+        blockid_t *id = (blockid_t *)&txn[sizeof(h)];
+        char *data = &txn[ids];
+        for (auto &p : pending) {
+            *id++ = p.first;
+            memcpy(data, p.second.data(), bs);
+            data += bs;
+        }
+        for (blockid_t r : revoked) *id++ = r;
+        for (auto &c : crcs) {
+            *id++ = c.first;
+            *id++ = c.second;
+        }
+        h.checksum =
+            journal_checksum(&txn[sizeof(h)], data - &txn[sizeof(h)]);
+        memcpy(&txn[0], &h, sizeof(h));
+        h.magic = JOURNAL_COMMIT;
+        memcpy(data, &h, sizeof(h));
 
-    uint32_t bitmap_blocks = BLOCK_NUM / BPB;
-    uint32_t inode_table_blocks = INODE_NUM / IPB;
-    uint32_t reserved = 2 + bitmap_blocks + inode_table_blocks;
-    for (uint32_t i = 0; i < reserved; i++) using_blocks[i] = 1;
-    pthread_mutex_init(&lock, NULL);
+        // nobody can log while we are committing, readers still see pending.
+        // The data blocks go first, so that their checksums never get ahead
+        // of them.
+        pthread_mutex_unlock(&lock);
+        for (auto c = crcs.begin(); c != crcs.end();) {
+            blockid_t first = c->first;
+            uint32_t n = 0;
+            for (; c != crcs.end() && c->first == first + n; ++c) n++;
+            d->flush(first, n);
+        }
+        if (pwrite(fd, txn.data(), txn.size(), tail) != (ssize_t)txn.size() ||
+            fdatasync(fd) < 0) {
+            perror("journal: commit");
+            exit(1);
+        }
+        pthread_mutex_lock(&lock);
+        for (auto &p : pending) d->write_block(p.first, p.second.data());
+        pending.clear();
+        revoked.clear();
+        crcs.clear();
+        tail += txn.size();
+    }
+    committed = s;
+    seq++;
+    if (tail > JOURNAL_MAX) truncate();
+    committing = false;
+    pthread_cond_broadcast(&cond);
 }
 
-inline void block_manager::read_block(uint32_t id, char *buf) {
-    d->read_block(id, buf);
+// Make the installed blocks durable in place so that the journal file can
+// be emptied. Called with the lock held while committing.
+void journal::truncate() {
+    pthread_mutex_unlock(&lock);
+    d->sync();
+    if (ftruncate(fd, 0) < 0 || fdatasync(fd) < 0)
+        perror("journal: checkpoint");
+    pthread_mutex_lock(&lock);
+    tail = 0;
 }
 
-void block_manager::write_block(uint32_t id, const char *buf) {
+// Record the new contents of metadata block id in the current transaction.
+void journal::log_write(blockid_t id, const char *buf) {
     pthread_mutex_lock(&lock);
-    d->write_block(id, buf);
+    std::vector<char> &b = pending[id];
+    b.assign(buf, buf + d->bsize());
+    revoked.erase(id);
+    crcs.erase(id);
     pthread_mutex_unlock(&lock);
 }
 
-// inode layer -----------------------------------------
+// Record the checksum crc of data block id, just written in place, in the
+// current transaction.
+void journal::log_crc(blockid_t id, uint32_t crc) {
+    pthread_mutex_lock(&lock);
+    crcs[id] = crc;
+    pending.erase(id);
+    pthread_mutex_unlock(&lock);
+}
 
-inode_manager::inode_manager() {
-    bm = new block_manager();
-    srand(getpid());
-    pthread_mutex_init(&lock, NULL);
-    uint32_t root_dir = alloc_inode(extent_protocol::T_DIR);
-    if (root_dir != 1) {
-        printf("\tim: error! alloc first inode %d, should be 1\n", root_dir);
-        exit(0);
-    }
+// Block id was freed: drop its logged contents and keep older transactions
+// from overwriting it at replay.
+void journal::revoke(blockid_t id) {
+    pthread_mutex_lock(&lock);
+    pending.erase(id);
+    crcs.erase(id);
+    revoked.insert(id);
+    pthread_mutex_unlock(&lock);
 }
 
-/* Create a new file.
- * Return its inum. */
-uint32_t inode_manager::alloc_inode(uint32_t type) {
-    /*
-     * your code goes here.
-     * note: the normal inode block should begin from the 2nd inode block.
-     * the 1st is used for root_dir, see inode_manager::inode_manager().
-     */
-
-    inode_t *inode_buf;
+// Copy the not yet installed contents of block id, if it has any.
+bool journal::read_pending(blockid_t id, char *buf) {
     pthread_mutex_lock(&lock);
-    // Allocate root dir (inode=1)
-    if (get_inode(1) == NULL) {
-        // printf("> im: alloc_inode root 1\n");
-        inode_t ino;
-        ino.type = type;
-        ino.size = 0;
-        std::time_t time = std::time(NULL);
-        ino.ctime = time;
-        ino.atime = time;
-        ino.mtime = time;
-        put_inode(1, &ino);
-        pthread_mutex_unlock(&lock);
-        return 1;
-    }
-    // random choose:
-    // Find a free inode in inode table
-    uint32_t upbound = bm->sb.ninodes - 1;
-    size_t iter = 0;
-    while (++iter <= bm->sb.ninodes) {
-        uint32_t i = 1 + rand() % upbound;
-        inode_buf = get_inode(i);
-        if (inode_buf == NULL) {
-            // printf("> im: alloc_inode %d\n", i);
-            inode_t ino;
-            ino.type = type;
-            ino.size = 0;
-            std::time_t time = std::time(NULL);
-            ino.ctime = time;
-            ino.atime = time;
-            ino.mtime = time;
-            put_inode(i, &ino);
-            pthread_mutex_unlock(&lock);
-            return i;
-        }
-    }
-    printf("!!! Failed to allocate an inode\n");
+    auto it = pending.find(id);
+    bool found = it != pending.end();
+    if (found) memcpy(buf, it->second.data(), d->bsize());
     pthread_mutex_unlock(&lock);
-    return 1;
+    return found;
 }
 
-std::vector<extent_protocol::extentid_t> inode_manager::alloc_ninode(
-    uint32_t type, int n) {
-    inode_t *inode_buf;
+// Commit what has been logged so far unless an operation is still running,
+// make the disk durable and empty the journal file.
+void journal::checkpoint() {
     pthread_mutex_lock(&lock);
-    // Allocate root dir (inode=1)
-    if (get_inode(1) == NULL) {
-        // printf("> im: alloc_inode root 1\n");
-        inode_t ino;
-        ino.type = type;
-        ino.size = 0;
-        std::time_t time = std::time(NULL);
-        ino.ctime = time;
-        ino.atime = time;
-        ino.mtime = time;
-        put_inode(1, &ino);
-    }
-    // random choose: Find a free inode in inode table
-    uint32_t upbound = bm->sb.ninodes - 1;
-    size_t iter = 0;
-    std::vector<extent_protocol::extentid_t> inumArray;
-    while (++iter <= bm->sb.ninodes && n > 0) {
-        uint32_t i = 1 + rand() % upbound;
-        inode_buf = get_inode(i);
-        if (inode_buf == NULL) {
-            n--;
-            inode_t ino;
-            ino.type = type;
-            ino.size = 0;
-            std::time_t time = std::time(NULL);
-            ino.ctime = time;
-            ino.atime = time;
-            ino.mtime = time;
-            put_inode(i, &ino);
-            inumArray.push_back(i);
-        }
-    }
-    // printf("!!! Failed to allocate an inode\n");
+    while (committing) pthread_cond_wait(&cond, &lock);
+    if (outstanding == 0) commit();
+    while (committing) pthread_cond_wait(&cond, &lock);
+    committing = true;
+    truncate();
+    committing = false;
+    pthread_cond_broadcast(&cond);
     pthread_mutex_unlock(&lock);
-    return inumArray;
 }
 
-void inode_manager::free_inode(uint32_t inum) {
-    /*
-     * your code goes here.
-     * note: you need to check if the inode is already a freed one;
-     * if not, clear it, and remember to write back to disk.
-     */
-    blockid_t inode_block_id = IBLOCK(inum, bm->sb.nblocks);
-    char buf[BLOCK_SIZE];
-    bm->read_block(inode_block_id, buf);
-    struct inode *ino = (struct inode *)buf;
-    if (ino->type == 0) return;
-    ino->type = 0;
-    // Free all its blocks
-    for (int i = 0; i < round(ino->size / (double)BLOCK_SIZE); i++) {
-        bm->free_block(ino->blocks[i]);
-    }
-    return;
+// block layer -----------------------------------------
+
+geometry::geometry(uint32_t block_size, uint32_t nblocks, uint32_t ninodes)
+    : block_size(block_size), nblocks(nblocks), ninodes(ninodes) {
+    shift = block_size ? __builtin_ctz(block_size) : 0;
+    ipb = block_size / sizeof(inode_t);
+    bpb = block_size * 8;
+    epb = block_size > 8 ? (block_size - 8) / sizeof(extent_t) : 0;
+    bitmap_blocks = bpb ? (nblocks + bpb - 1) / bpb : 0;
+    itable_blocks = ipb ? ninodes / ipb : 0;
+    snap_table_blocks =
+        block_size ? (itable_blocks * sizeof(blockid_t) + block_size - 1) /
+                         block_size
+                   : 0;
+    // as many groups as there are bitmap blocks, up to AG_COUNT
+    uint32_t per_group = (bitmap_blocks + AG_COUNT - 1) / AG_COUNT;
+    ag_blocks = per_group * bpb;
+    ngroups = per_group ? (bitmap_blocks + per_group - 1) / per_group : 0;
+    ag_inodes = ninodes / AG_COUNT;
+    uint32_t ids = block_size / sizeof(blockid_t);
+    snap_index_blocks = snap_table_blocks <= SNAP_TABLE_MAX
+                            ? 0
+                            : (snap_table_blocks + ids - 1) / ids;
 }
 
-/* Return an inode structure by inum, NULL otherwise.
- * Caller should release the memory. */
-struct inode *inode_manager::get_inode(uint32_t inum) {
-    struct inode *ino, *ino_disk;
-    char buf[BLOCK_SIZE];
+// Whether a disk can be formatted with this geometry. The inode groups
+// must be whole words of inode_used, and the snapshot table, or its
+// index, must fit the superblock.
+bool geometry::valid() const {
+    return block_size >= BLOCK_SIZE_MIN && block_size <= BLOCK_SIZE_MAX &&
+           (block_size & (block_size - 1)) == 0 && nblocks % 64 == 0 &&
+           nblocks < 0x80000000 && ninodes >= AG_COUNT * 64 &&
+           ninodes % (AG_COUNT * 64) == 0 &&
+           snap_index_blocks <= SNAP_TABLE_MAX && iblock(ninodes) < nblocks;
+}
 
-    // printf("\tim: get_inode %d\n", inum);
+// Read the geometry of image from its superblock, trying every block size
+// for where it is. Return false if image is not formatted.
+bool probe_geometry(const char *image, geometry_t &geo) {
+    int fd = open(image, O_RDONLY);
+    if (fd < 0) return false;
+    bool found = false;
+    superblock_t sb;
+    for (uint32_t bs = BLOCK_SIZE_MIN; !found && bs <= BLOCK_SIZE_MAX;
+         bs *= 2) {
+        if (pread(fd, &sb, sizeof(sb), bs) != sizeof(sb) ||
+            sb.magic != SB_MAGIC ||
+            (sb.block_size ? sb.block_size : BLOCK_SIZE_MIN) != bs)
+            continue;
+        geo = geometry_t(bs, sb.nblocks, sb.ninodes);
+        found = geo.valid();
+    }
+    close(fd);
+    return found;
+}
 
-    // if (inum < 0 || inum >= INODE_NUM) {
-    //     printf("\tim: inum out of range\n");
-    //     return NULL;
-    // }
+// Whether another process has image mounted, see disk::disk. Closing the
+// descriptor drops the locks of this process on image, so it is only for
+// one that has not mounted it.
+bool image_in_use(const char *image) {
+    int fd = open(image, O_RDONLY);
+    if (fd < 0) return false;
+    struct flock fl = {};
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    bool used = fcntl(fd, F_GETLK, &fl) == 0 && fl.l_type != F_UNLCK;
+    close(fd);
+    return used;
+}
 
-    bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
+// The free block bitmap is kept in memory as 64-bit words, word w holding the
+// bits of blocks [64w, 64w + 64). Its bytes are exactly the bytes of the
+// bitmap region (little-endian), so it is loaded and stored as raw blocks.
+#define WORD_BITS 64
 
-    ino_disk = (struct inode *)buf;
-    if (ino_disk->type == 0) {
-        // printf("\tim: inode not exist\n");
-        return NULL;
+static inline bool bit_used(const std::vector<uint64_t> &bm, uint32_t b) {
+    return (bm[b / WORD_BITS] >> (b % WORD_BITS)) & 1;
+}
+
+// Find the first free block in [from, to), scanning a word at a time.
+// Return to if there is none.
+uint32_t block_manager::next_free(uint32_t from, uint32_t to) const {
+    while (from < to) {
+        uint32_t w = from / WORD_BITS;
+        uint64_t avail = ~bitmap[w] & (~0ULL << (from % WORD_BITS));
+        if (avail) {
+            uint32_t b = w * WORD_BITS + __builtin_ctzll(avail);
+            return b < to ? b : to;
+        }
+        from = (w + 1) * WORD_BITS;
     }
+    return to;
+}
 
-    ino = (struct inode *)malloc(sizeof(struct inode));
-    *ino = *ino_disk;
+// Find the first used block in [from, to), return to if there is none.
+uint32_t block_manager::next_used(uint32_t from, uint32_t to) const {
+    while (from < to) {
+        uint32_t w = from / WORD_BITS;
+        uint64_t used = bitmap[w] & (~0ULL << (from % WORD_BITS));
+        if (used) {
+            uint32_t b = w * WORD_BITS + __builtin_ctzll(used);
+            return b < to ? b : to;
+        }
+        from = (w + 1) * WORD_BITS;
+    }
+    return to;
+}
 
-    return ino;
+// Search [from, to) for n contiguous free blocks, return to on failure.
+uint32_t block_manager::find_run(uint32_t from, uint32_t to,
+                                 uint32_t n) const {
+    while (from < to) {
+        uint32_t start = next_free(from, to);
+        if (to - start < n) break;
+        uint32_t end = next_used(start, start + n);
+        if (end == start + n) return start;
+        from = end;
+    }
+    return to;
 }
 
-void inode_manager::put_inode(uint32_t inum, struct inode *ino) {
-    char buf[BLOCK_SIZE];
-    struct inode *ino_disk;
+// Mark blocks [start, start + n) used or free. Caller holds the lock of
+// their groups.
+void block_manager::set_bits(uint32_t start, uint32_t n, bool used) {
+    for (uint32_t b = start; b < start + n; b++) {
+        alloc_group_t &g = groups[b / geom.ag_blocks];
+        if (used) {
+            bitmap[b / WORD_BITS] |= 1ULL << (b % WORD_BITS);
+            g.nfree--;
+        } else {
+            bitmap[b / WORD_BITS] &= ~(1ULL << (b % WORD_BITS));
+            g.nfree++;
+        }
+    }
+}
 
-    // printf("\tim: put_inode %d\n", inum);
-    if (ino == NULL) return;
+// Store the bitmap blocks covering blocks [first, last] to the disk.
+void block_manager::store_bitmap(uint32_t first, uint32_t last) {
+    const char *raw = (const char *)bitmap.data();
+    for (uint32_t i = first / geom.bpb; i <= last / geom.bpb; i++)
+        log_block(geom.bblock(i * geom.bpb), raw + i * geom.block_size);
+}
 
-    bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
-    ino_disk = (struct inode *)buf + inum % IPB;
-    *ino_disk = *ino;
-    bm->write_block(IBLOCK(inum, bm->sb.nblocks), buf);
+// Allocate a free disk block.
+blockid_t block_manager::alloc_block() {
+    blockid_t id;
+    if (!alloc_blocks(1, &id)) return sb.nblocks;
+    return id;
 }
 
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
+// Group that allocations without a goal go to for the calling thread, so
+// that threads spread over the groups.
+static uint32_t home_group() {
+    static std::atomic<uint32_t> next(0);
+    static thread_local uint32_t home = next++ % AG_COUNT;
+    return home;
+}
 
-/* Get all the data of a file by inum.
- * Return alloced data, should be freed by caller. */
-void inode_manager::read_file(uint32_t inum, char **buf_out, int *size) {
-    /*
-     * your code goes here.
-     * note: read blocks related to inode number inum,
-     * and copy them to buf_out
-     */
-    pthread_mutex_lock(&lock);
-    inode_t *ino = get_inode(inum);
-    if (ino == NULL) {
-        printf("ERR! inode %d not found\n", inum);
-        pthread_mutex_unlock(&lock);
-        return;
+// Allocate n blocks of group g into ids. A single contiguous run is
+// preferred; on a fragmented group the free blocks nearest to the next-fit
+// cursor are taken instead. A goal block in the group is searched from
+// instead of the cursor. Caller holds the lock of g, which has n free
+// blocks.
+void block_manager::alloc_in(alloc_group_t &g, uint32_t n, blockid_t *ids,
+                             blockid_t goal) {
+    uint32_t from = goal >= g.start && goal < g.end ? goal : g.cursor;
+    uint32_t start = find_run(from, g.end, n);
+    if (start == g.end) {
+        // wrap around, the run may end right before where we started
+        uint32_t to = MIN(from + n - 1, g.end);
+        start = find_run(g.start, to, n);
+        if (start == to) start = g.end;
     }
-    *size = ino->size;
-    int nblk = NBLK(ino->size);
-    char *tmp = (char *)malloc((nblk * BLOCK_SIZE));
-    int block_idx;
-    for (block_idx = 0; block_idx < nblk; block_idx++) {
-        blockid_t bid = get_inode_block(ino, block_idx);
-        bm->read_block(bid, tmp + block_idx * BLOCK_SIZE);
+    if (start < g.end) {
+        for (uint32_t i = 0; i < n; i++) ids[i] = start + i;
+        set_bits(start, n, true);
+        g.cursor = start + n;
+    } else {
+        uint32_t b = from;
+        for (uint32_t i = 0; i < n; i++) {
+            b = next_free(b, g.end);
+            if (b == g.end) b = next_free(g.start, g.end);
+            ids[i] = b;
+            set_bits(b, 1, true);
+            b++;
+        }
+        g.cursor = b;
     }
-    *buf_out = tmp;
-    // udpate metadata
-    std::time_t time = std::time(NULL);
-    ino->atime = (unsigned int)time;
-    put_inode(inum, ino);
-    pthread_mutex_unlock(&lock);
-    free(ino);
-    return;
+    if (g.cursor >= g.end) g.cursor = g.start;
+    uint32_t lo = ids[0], hi = ids[0];
+    for (uint32_t i = 1; i < n; i++) {
+        lo = MIN(lo, ids[i]);
+        hi = MAX(hi, ids[i]);
+    }
+    store_bitmap(lo, hi);
 }
 
-/* alloc/free blocks if needed */
-void inode_manager::write_file(uint32_t inum, const char *buf, int size) {
-    /*
-     * your code goes here.
-     * note: write buf to blocks of inode inum.
-     * you need to consider the situation when the size of buf
-     * is larger or smaller than the size of original inode
-     */
-    pthread_mutex_lock(&lock);
-    inode_t *ino = get_inode(inum);
-    if (ino == NULL) {
-        printf("ERR! inode %d not found\n", inum);
-        pthread_mutex_unlock(&lock);
-        return;
+// Blocks of an earlier reservation that the allocations of this thread take,
+// see block_manager::draw_reserved.
+static thread_local uint32_t drawing = 0;
+
+// Allocate n blocks into ids, all or nothing. They come from the group of
+// the goal block, e.g. the one right after a file's last extent, if it has
+// room, else from the next group that has, else from several groups.
+// Blocks reserved for other data are not taken.
+bool block_manager::alloc_blocks(uint32_t n, blockid_t *ids, blockid_t goal) {
+    if (n == 0) return true;
+    uint32_t covered = MIN(n, drawing);
+    if (n > covered && !reserve(n - covered)) return false;
+    drawing -= covered;
+    bool has_goal = goal >= data_start && goal < sb.nblocks;
+    uint32_t ngroups = geom.ngroups;
+    uint32_t first = has_goal ? goal / geom.ag_blocks : home_group() % ngroups;
+    for (uint32_t k = 0; k < ngroups; k++) {
+        alloc_group_t &g = groups[(first + k) % ngroups];
+        pthread_mutex_lock(&g.lock);
+        bool ok = g.nfree >= n;
+        if (ok) alloc_in(g, n, ids, k == 0 ? goal : 0);
+        pthread_mutex_unlock(&g.lock);
+        if (ok) return true;
     }
-    if ((unsigned)size > MAXFILE * BLOCK_SIZE) {
-        printf("ERR! File size is too large to support!");
-        pthread_mutex_unlock(&lock);
-        return;
+    uint32_t got = 0;
+    for (uint32_t k = 0; k < ngroups && got < n; k++) {
+        alloc_group_t &g = groups[(first + k) % ngroups];
+        pthread_mutex_lock(&g.lock);
+        uint32_t m = MIN(g.nfree, n - got);
+        if (m) alloc_in(g, m, ids + got, 0);
+        pthread_mutex_unlock(&g.lock);
+        got += m;
     }
-    int o_blk_num = NBLK(ino->size);
-    int new_blk_num = NBLK(size);
-    // Make a copy of data, when accessing this data as multiple BLOCK_SIZE
-    // blocks, it's possible to access past the boundary of memory, leading to
-    // segmentation fault
-    char *copy = (char *)calloc(new_blk_num, BLOCK_SIZE);
-    memcpy(copy, buf, size);
-    buf = copy;
-    if (new_blk_num > o_blk_num) {
-        int i;
-        int di_addition = new_blk_num < NDIRECT ? new_blk_num : NDIRECT;
-        for (i = o_blk_num; i < di_addition; i++) {
-            blockid_t bid = bm->alloc_block();
-            ino->blocks[i] = bid;
-        }
-        if (i < new_blk_num) {
-            ino->blocks[NDIRECT] = bm->alloc_block();
-        }
-        if (i < new_blk_num) {
-            blockid_t indirect_id = ino->blocks[NDIRECT];
-            char buf[BLOCK_SIZE];
-            bm->read_block(indirect_id, buf);
-            // Unrolling
-            while (i + 1 < new_blk_num) {
-                blockid_t id = bm->alloc_block();
-                blockid_t id2 = bm->alloc_block();
-                ((blockid_t *)buf)[i - NDIRECT] = id;
-                ((blockid_t *)buf)[i + 1 - NDIRECT] = id2;
-                i += 2;
-            }
-            if (i < new_blk_num) {
-                blockid_t id = bm->alloc_block();
-                ((blockid_t *)buf)[i - NDIRECT] = id;
-            }
-            bm->write_block(indirect_id, buf);
-        }
-    } else if (new_blk_num < o_blk_num) {
-        // free blocks
-        int diff = o_blk_num - new_blk_num;
-        for (int i = 0; i < diff; i++) {
-            bm->free_block(get_inode_block(ino, new_blk_num + i));
+    if (got == n) return true;
+    // the blocks go back to where they were taken from
+    for (uint32_t i = 0; i < got; i++) free_block(ids[i]);
+    unreserved -= got;
+    unreserve(n - covered);
+    drawing += covered;
+    return false;
+}
+
+// Set aside n free blocks for data to be allocated later, which then draws
+// from them, see draw_reserved. Return false if there are not that many
+// free blocks left that are not already set aside, unless force.
+bool block_manager::reserve(uint32_t n, bool force) {
+    if (force) {
+        unreserved -= n;
+        return true;
+    }
+    int64_t avail = unreserved.load();
+    while (avail >= n)
+        if (unreserved.compare_exchange_weak(avail, avail - n)) return true;
+    return false;
+}
+
+void block_manager::unreserve(uint32_t n) {
+    unreserved += n;
+}
+
+// Let the next allocations of the calling thread take up to n blocks
+// reserved earlier, instead of free blocks that are not. end_draw()
+// releases what they did not take.
+void block_manager::draw_reserved(uint32_t n) {
+    drawing = n;
+}
+
+void block_manager::end_draw() {
+    unreserve(drawing);
+    drawing = 0;
+}
+
+void block_manager::free_block(uint32_t id) {
+    free_blocks(id, 1);
+}
+
+// Free the n blocks starting at start, skipping the ones already free.
+void block_manager::free_blocks(uint32_t start, uint32_t n) {
+    if (n == 0 || start < data_start || start + n > sb.nblocks) return;
+    while (n > 0) {
+        alloc_group_t &g = groups[start / geom.ag_blocks];
+        uint32_t m = MIN(n, g.end - start);
+        pthread_mutex_lock(&g.lock);
+        for (uint32_t b = start; b < start + m; b++) {
+            if (!bit_used(bitmap, b)) continue;
+            set_bits(b, 1, false);
+            unreserved++;
+            if (j) j->revoke(b);
         }
+        store_bitmap(start, start + m - 1);
+        pthread_mutex_unlock(&g.lock);
+        start += m;
+        n -= m;
     }
-    // Write new file data
-    int block_idx;
-    for (block_idx = 0; block_idx < new_blk_num; block_idx++) {
-        blockid_t bid = get_inode_block(ino, block_idx);
-        bm->write_block(bid, buf + block_idx * BLOCK_SIZE);
+}
+
+// Number of free blocks, over all groups.
+uint32_t block_manager::nfree() {
+    uint32_t n = 0;
+    for (alloc_group_t &g : groups) {
+        pthread_mutex_lock(&g.lock);
+        n += g.nfree;
+        pthread_mutex_unlock(&g.lock);
     }
-    // update metadata
-    ino->size = size;
-    std::time_t time = std::time(NULL);
-    ino->atime = time;
-    ino->mtime = time;
-    ino->ctime = time;
+    return n;
+}
 
-    // write back inode
-    put_inode(inum, ino);
-    // std::cout << " im: write_file return" << std::endl;
-    pthread_mutex_unlock(&lock);
-    // std::cout << " im: write_file return" << std::endl;
-    free(ino);
-    return;
+// Copy the bitmap into bits, one bit per block as in bitmap.
+void block_manager::get_bitmap(std::vector<uint64_t> &bits) {
+    for (alloc_group_t &g : groups) pthread_mutex_lock(&g.lock);
+    bits = bitmap;
+    for (alloc_group_t &g : groups) pthread_mutex_unlock(&g.lock);
 }
 
-void inode_manager::getattr(uint32_t inum, extent_protocol::attr &a) {
-    /*
-     * your code goes here.
-     * note: get the attributes of inode inum.
-     * you can refer to "struct attr" in extent_protocol.h
-     */
-    inode_t *ino = get_inode(inum);
-    if (ino == NULL) {
-        a.type = 0;
-        return;
+// Mark block id used, if it is not already, without allocating it.
+void block_manager::use_block(uint32_t id) {
+    if (id < data_start || id >= sb.nblocks) return;
+    alloc_group_t &g = groups[id / geom.ag_blocks];
+    pthread_mutex_lock(&g.lock);
+    if (!bit_used(bitmap, id)) {
+        set_bits(id, 1, true);
+        unreserved--;
+        store_bitmap(id, id);
     }
-    a.type = ino->type;
-    a.atime = ino->atime;
-    a.mtime = ino->mtime;
-    a.ctime = ino->ctime;
-    a.size = ino->size;
-    free(ino);
+    pthread_mutex_unlock(&g.lock);
 }
 
-void inode_manager::remove_file(uint32_t inum) {
-    /*
-     * your code goes here
-     * note: you need to consider about both the data block and inode of the
-     * file
-     */
-    pthread_mutex_lock(&lock);
-    inode_t *ino = get_inode(inum);
-    if (ino == NULL) {
-        printf("ERR! remove_file: inum not exist\n");
-        pthread_mutex_unlock(&lock);
-        // printf("ERR! remove_file: inum not exist\n");
-        return;
+// Set up the groups once data_start is known, all their blocks free. The
+// last group may be short, and the groups past ngroups are empty.
+void block_manager::init_groups() {
+    for (uint32_t i = 0; i < AG_COUNT; i++) {
+        alloc_group_t &g = groups[i];
+        uint32_t begin = MIN(i * geom.ag_blocks, sb.nblocks);
+        g.end = MIN((i + 1) * geom.ag_blocks, sb.nblocks);
+        g.start = MIN(MAX(begin, data_start), g.end);
+        g.cursor = g.start;
+        g.nfree = g.end - begin;
     }
-    // freedom to blocks
-    uint32_t size = ino->size;
-    int nblk = NBLK(size);
-    int block_idx;
-    int bound = nblk < NDIRECT ? nblk : NDIRECT;
-    for (block_idx = 0; block_idx < bound; block_idx++) {
-        bm->free_block(ino->blocks[block_idx]);
+}
+
+// The layout of disk should be like this:
+// |<-sb->|<-free block bitmap->|<-inode table->|<-data->|
+// A new disk is formatted with geometry geo, an existing image keeps the
+// one it was formatted with. An image that has data but no superblock we
+// know is left alone rather than formatted over.
+block_manager::block_manager(const char *image, const geometry_t &geo)
+    : geom(geo) {
+    bool formatted = image && probe_geometry(image, geom);
+    struct stat st;
+    if (image && !formatted && stat(image, &st) == 0 && st.st_size > 0) {
+        printf("\tbm: error! %s is not a yfs image, not formatting it\n",
+               image);
+        exit(1);
     }
-    // indirect read
-    if (block_idx < nblk) {
-        blockid_t indirect_blk_id = (blockid_t)ino->blocks[NDIRECT];
-        char blockid_block[BLOCK_SIZE];
-        bm->read_block(indirect_blk_id, blockid_block);
-        for (; block_idx < nblk; block_idx++) {
-            bm->free_block(((blockid_t *)blockid_block)[block_idx - NDIRECT]);
-        }
+    if (!geom.valid()) {
+        printf("\tbm: error! bad geometry, %u blocks of %u bytes, %u inodes\n",
+               geom.nblocks, geom.block_size, geom.ninodes);
+        exit(1);
     }
-    // reset metadata
-    ino->type = 0;  // mark as deleted
-    ino->size = 0;
-    std::time_t time = std::time(NULL);
-    ino->mtime = time;
-    put_inode(inum, ino);
-    pthread_mutex_unlock(&lock);
-    free(ino);
-    return;
-}
+    d = image ? new disk(image, geom.block_size, geom.nblocks)
+              : new disk(geom.block_size, geom.nblocks);
+    // an image gets a journal next to it, replayed before anything is read
+    j = image ? new journal(d, (std::string(image) + ".journal").c_str())
+              : NULL;
+    for (alloc_group_t &g : groups) pthread_mutex_init(&g.lock, NULL);
+    verify_mode = VERIFY_MISS;
 
-blockid_t inode_manager::get_inode_block(inode_t *ino, unsigned int idx) const {
-    if (idx < NDIRECT) {
-        return ino->blocks[idx];
+    if (formatted) {
+        char buf[BLOCK_SIZE_MAX];
+        d->read_block(1, buf);
+        sb = *(superblock_t *)buf;
+        mount();
     } else {
-        blockid_t indirect_blk_id = ino->blocks[NDIRECT];
-        char buf[BLOCK_SIZE];
-        bm->read_block(indirect_blk_id, buf);
-        return ((blockid_t *)buf)[idx - NDIRECT];
+        format();
+    }
+}
+
+// The disk syncs as it goes, and what is committed but not yet checkpointed
+// stays in the journal file.
+block_manager::~block_manager() {
+    delete j;
+    delete d;
+    for (alloc_group_t &g : groups) pthread_mutex_destroy(&g.lock);
+}
+
+void block_manager::format() {
+    bzero(&sb, sizeof(sb));
+    sb.magic = SB_MAGIC;
+    sb.size = MIN((uint64_t)geom.block_size * geom.nblocks, UINT32_MAX);
+    sb.nblocks = geom.nblocks;
+    sb.ninodes = geom.ninodes;
+    sb.block_size = geom.block_size;
+
+    // clear the bitmap and the inode table
+    char buf[BLOCK_SIZE_MAX];
+    bzero(buf, sizeof(buf));
+    data_start = geom.iblock(sb.ninodes);
+    for (uint32_t i = 2; i < data_start; i++) d->write_block(i, buf);
+
+    // init free block map, everything before the data region is in use, and
+    // the bits past the last block never are free
+    bitmap = std::vector<uint64_t>(
+        (size_t)geom.bitmap_blocks * geom.block_size / sizeof(uint64_t), 0);
+    for (uint32_t w = sb.nblocks / WORD_BITS; w < bitmap.size(); w++)
+        bitmap[w] = ~0ULL;
+    init_groups();
+    set_bits(0, data_start, true);
+    unreserved = nfree();
+    begin_op();
+    store_bitmap(0, sb.nblocks - 1);
+    wait_op(end_op());
+
+    // the superblock goes last, an image is valid once it is there
+    memcpy(buf, &sb, sizeof(sb));
+    d->write_block(1, buf);
+    d->sync();
+}
+
+// Load the bitmap of an existing image.
+void block_manager::mount() {
+    bitmap = std::vector<uint64_t>(
+        (size_t)geom.bitmap_blocks * geom.block_size / sizeof(uint64_t), 0);
+    char *raw = (char *)bitmap.data();
+    for (uint32_t i = 0; i < geom.bitmap_blocks; i++)
+        d->read_block(geom.bblock(i * geom.bpb), raw + i * geom.block_size);
+    data_start = geom.iblock(sb.ninodes);
+    init_groups();
+    for (uint32_t w = 0; w < sb.nblocks / WORD_BITS; w++)
+        groups[w * WORD_BITS / geom.ag_blocks].nfree -=
+            __builtin_popcountll(bitmap[w]);
+    unreserved = nfree();
+    printf("\tbm: mounted existing image, %u blocks, %u free\n", sb.nblocks,
+           nfree());
+}
+
+// Whether a block matches its checksum, reporting it if not.
+bool block_manager::check(uint32_t id, const char *buf) const {
+    if (d->verify(id, buf)) return true;
+    printf("\tbm: error! checksum mismatch on block %u\n", id);
+    return false;
+}
+
+// Check a block read outside the buffer cache: always with VERIFY_ALL,
+// and with VERIFY_MISS only until it has matched once since it was last
+// written, so that reading the same data again costs no checksum.
+inline bool block_manager::check_read(uint32_t id, const char *buf) {
+    if (verify_mode == VERIFY_ALL) return check(id, buf);
+    if (verify_mode == VERIFY_MISS && !d->was_checked(id)) {
+        if (!check(id, buf)) return false;
+        d->set_checked(id);
+    }
+    return true;
+}
+
+// Return false if the block does not match its checksum.
+inline bool block_manager::read_block(uint32_t id, char *buf) {
+    if (j && j->read_pending(id, buf)) return true;
+    d->read_block(id, buf);
+    return check_read(id, buf);
+}
+
+// Read a block into the buffer cache, checking it unless verification is
+// off. Steady-state reads then hit the cache and are not checked again.
+void block_manager::read_block_checked(uint32_t id, char *buf) {
+    if (j && j->read_pending(id, buf)) return;
+    d->read_block(id, buf);
+    if (verify_mode != VERIFY_NONE) check(id, buf);
+}
+
+// Data blocks belong to one file, whose lock the caller holds within an
+// operation. They are written in place, their checksums go in the journal.
+void block_manager::write_block(uint32_t id, const char *buf) {
+    d->write_block(id, buf);
+    if (j) j->log_crc(id, d->crc(id));
+}
+
+// As for read_block, false if any of the blocks does not match.
+inline bool block_manager::read_blocks(uint32_t id, uint32_t n, char *buf) {
+    d->read_blocks(id, n, buf);
+    bool ok = true;
+    if (verify_mode != VERIFY_NONE)
+        for (uint32_t i = 0; i < n; i++)
+            ok = check_read(id + i, buf + (size_t)i * geom.block_size) && ok;
+    return ok;
+}
+
+void block_manager::write_blocks(uint32_t id, uint32_t n, const char *buf) {
+    d->write_blocks(id, n, buf);
+    if (j)
+        for (uint32_t i = 0; i < n; i++) j->log_crc(id + i, d->crc(id + i));
+}
+
+// Write a metadata block (bitmap, inode or extent block). It goes through
+// the journal when there is one. May be called with the lock held.
+void block_manager::log_block(uint32_t id, const char *buf) {
+    if (j)
+        j->log_write(id, buf);
+    else
+        d->write_block(id, buf);
+}
+
+// Write the superblock back. Called within an operation.
+void block_manager::write_super() {
+    char buf[BLOCK_SIZE_MAX];
+    bzero(buf, sizeof(buf));
+    memcpy(buf, &sb, sizeof(sb));
+    log_block(1, buf);
+}
+
+// Operations that log blocks are bracketed by begin_op/end_op, and wait_op
+// makes them durable. All three are no-ops without a journal.
+void block_manager::begin_op() {
+    if (j) j->begin_op();
+}
+
+uint32_t block_manager::end_op() {
+    return j ? j->end_op() : 0;
+}
+
+void block_manager::wait_op(uint32_t seq) {
+    if (j) j->wait(seq);
+}
+
+void block_manager::sync() {
+    if (j)
+        j->checkpoint();
+    else
+        d->sync();
+}
+
+// buffer cache layer -----------------------------------------
+
+buffer_cache::buffer_cache(block_manager *bm, size_t capacity)
+    : bm(bm), capacity(capacity), hits(0), misses(0), writebacks(0) {
+    pthread_mutex_init(&lock, NULL);
+}
+
+// Dirty buffers are lost, flush() first.
+buffer_cache::~buffer_cache() {
+    for (buf_t *b : lru) {
+        pthread_mutex_destroy(&b->mu);
+        delete[] b->data;
+        delete b;
+    }
+    pthread_mutex_destroy(&lock);
+}
+
+// Write a dirty buffer back to the block layer. Called with the lock held.
+void buffer_cache::write_back(buf_t *b) {
+    pthread_mutex_lock(&b->mu);
+    bm->log_block(b->id, b->data);
+    pthread_mutex_unlock(&b->mu);
+    b->dirty = false;
+    writebacks++;
+}
+
+// Find the buffer of block id, or recycle the least recently used unpinned
+// buffer for it, reading the block in if fill. The buffer returned is
+// pinned. The cache only grows past its capacity when every buffer is
+// pinned.
+buf_t *buffer_cache::lookup(blockid_t id, bool fill) {
+    pthread_mutex_lock(&lock);
+    buf_t *b;
+    auto it = table.find(id);
+    if (it != table.end()) {
+        b = it->second;
+        hits++;
+    } else {
+        misses++;
+        b = NULL;
+        if (lru.size() >= capacity) {
+            for (auto r = lru.rbegin(); r != lru.rend(); ++r) {
+                if ((*r)->refcnt == 0) {
+                    b = *r;
+                    break;
+                }
+            }
+        }
+        if (b == NULL) {
+            b = new buf_t;
+            b->data = new char[bm->geo().block_size];
+            b->id = 0;
+            b->refcnt = 0;
+            b->dirty = false;
+            pthread_mutex_init(&b->mu, NULL);
+            lru.push_front(b);
+            b->lru = lru.begin();
+        } else if (b->id != 0) {
+            if (b->dirty) write_back(b);
+            table.erase(b->id);
+        }
+        b->id = id;
+        table[id] = b;
+        if (fill)
+            bm->read_block_checked(id, b->data);
+        else
+            bzero(b->data, bm->geo().block_size);
+    }
+    b->refcnt++;
+    lru.splice(lru.begin(), lru, b->lru);
+    pthread_mutex_unlock(&lock);
+    return b;
+}
+
+// Get block id, pinned.
+buf_t *buffer_cache::bread(blockid_t id) {
+    return lookup(id, true);
+}
+
+// Get a buffer for block id without reading it, for a block about to be
+// entirely rewritten. A buffer that was not cached comes zeroed.
+buf_t *buffer_cache::bget(blockid_t id) {
+    return lookup(id, false);
+}
+
+// Mark a pinned buffer as modified.
+void buffer_cache::bwrite(buf_t *b) {
+    pthread_mutex_lock(&lock);
+    if (!b->dirty) {
+        b->dirty = true;
+        dirty.push_back(b);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void buffer_cache::brelse(buf_t *b) {
+    pthread_mutex_lock(&lock);
+    b->refcnt--;
+    pthread_mutex_unlock(&lock);
+}
+
+// Copy len bytes at off out of a pinned buffer. Inode table blocks are
+// shared by the inodes of several stripes, so the bytes of a buffer are
+// only accessed through read() and write().
+void buffer_cache::read(buf_t *b, size_t off, void *dst, size_t len) {
+    pthread_mutex_lock(&b->mu);
+    memcpy(dst, b->data + off, len);
+    pthread_mutex_unlock(&b->mu);
+}
+
+// Copy len bytes into a pinned buffer at off and mark it dirty.
+void buffer_cache::write(buf_t *b, size_t off, const void *src, size_t len) {
+    pthread_mutex_lock(&b->mu);
+    memcpy(b->data + off, src, len);
+    pthread_mutex_unlock(&b->mu);
+    bwrite(b);
+}
+
+// Drop block id, which is being freed, without writing it back, so that a
+// stale copy never overwrites the block once it is reused.
+void buffer_cache::forget(blockid_t id) {
+    pthread_mutex_lock(&lock);
+    auto it = table.find(id);
+    if (it != table.end()) {
+        buf_t *b = it->second;
+        table.erase(it);
+        b->id = 0;
+        b->dirty = false;
+        lru.splice(lru.end(), lru, b->lru);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// Write back every dirty buffer.
+void buffer_cache::flush() {
+    pthread_mutex_lock(&lock);
+    for (buf_t *b : dirty)
+        if (b->dirty) write_back(b);
+    dirty.clear();
+    pthread_mutex_unlock(&lock);
+}
+
+void buffer_cache::stats(uint64_t &h, uint64_t &m, uint64_t &w) {
+    pthread_mutex_lock(&lock);
+    h = hits;
+    m = misses;
+    w = writebacks;
+    pthread_mutex_unlock(&lock);
+}
+
+// inode layer -----------------------------------------
+
+// Make everything durable, then unmount: an image is unmapped and closed,
+// which lets another process mount it.
+inode_manager::~inode_manager() {
+    sync();
+    delete bc;
+    delete bm;
+}
+
+inode_manager::inode_manager(const char *image, const geometry_t &g) {
+    bm = new block_manager(image, g);
+    geo = bm->geo();
+    bc = new buffer_cache(bm);
+    map_cache_size = MAP_CACHE_SIZE;
+    for (int i = 0; i < INODE_LOCKS; i++)
+        pthread_mutex_init(&inode_locks[i], NULL);
+    for (int i = 0; i < AG_COUNT; i++)
+        pthread_mutex_init(&alloc_locks[i], NULL);
+    pthread_mutex_init(&map_lock, NULL);
+    pthread_mutex_init(&share_lock, NULL);
+    pthread_mutex_init(&snap_lock, NULL);
+    dedup = false;
+    delalloc = false;
+    npending = 0;
+    load_inode_index();
+    load_snapshot();
+    scan_blocks(false);
+    // A mounted image already has its root dir
+    if (inode_used[0] & (1ULL << 1)) return;
+    uint32_t root_dir = alloc_inode(extent_protocol::T_DIR);
+    if (root_dir != 1) {
+        printf("\tim: error! alloc first inode %d, should be 1\n", root_dir);
+        exit(0);
+    }
+}
+
+// The free inode index has one bit per inode in inode_used, plus one bit per
+// word of inode_used in inode_full that is set once the word has no free inode
+// left, a group having full_words words of inode_full. The lowest free inum of
+// a group is then found with a ctz per 4096 inodes and one more, whatever the
+// occupancy, and consecutive creates get neighbouring inums.
+void inode_manager::load_inode_index() {
+    uint32_t nwords = bm->sb.ninodes / 64;
+    inode_used = std::vector<uint64_t>(nwords, 0);
+    full_words = (geo.ag_inodes / 64 + 63) / 64;
+    inode_full = std::vector<uint64_t>(AG_COUNT * full_words, 0);
+    for (uint32_t g = 0; g < AG_COUNT; g++) inode_free[g] = geo.ag_inodes;
+    // inum 0 is never handed out
+    mark_inode(0, true);
+    // this also warms the buffer cache with the inode table
+    for (uint32_t inum = 1; inum < bm->sb.ninodes; inum++) {
+        buf_t *b = bc->bread(geo.iblock(inum));
+        inode_t ino;
+        bc->read(b, inum % geo.ipb * sizeof(inode_t), &ino, sizeof(ino));
+        if (ino.type != 0) mark_inode(inum, true);
+        bc->brelse(b);
+    }
+}
+
+// Caller holds the allocation lock of the group of inum.
+void inode_manager::mark_inode(uint32_t inum, bool used) {
+    uint32_t w = inum / 64;
+    uint32_t g = inum / geo.ag_inodes;
+    uint32_t gw = w % (geo.ag_inodes / 64);  // word within the group
+    uint64_t &full = inode_full[g * full_words + gw / 64];
+    uint64_t bit = 1ULL << (gw % 64);
+    if (((inode_used[w] >> (inum % 64)) & 1) == used) return;
+    if (used) {
+        inode_used[w] |= 1ULL << (inum % 64);
+        if (inode_used[w] == ~0ULL) full |= bit;
+        inode_free[g]--;
+    } else {
+        inode_used[w] &= ~(1ULL << (inum % 64));
+        full &= ~bit;
+        inode_free[g]++;
+    }
+}
+
+// Group a new inode of type goes to: a file goes to the group of its
+// parent directory, a directory to the group with the most free inodes, to
+// spread the trees over the groups. Without a parent, a file goes to the
+// group of the calling thread and a directory, like the root, to group 0.
+uint32_t inode_manager::pick_group(uint32_t type, uint32_t parent) {
+    if (parent == 0)
+        return type == extent_protocol::T_DIR ? 0 : home_group();
+    uint32_t g = parent / geo.ag_inodes % AG_COUNT;
+    if (type != extent_protocol::T_DIR) return g;
+    uint32_t best = g, most = 0;
+    for (uint32_t k = 1; k <= AG_COUNT; k++) {
+        uint32_t i = (g + k) % AG_COUNT;
+        pthread_mutex_lock(&alloc_locks[i]);
+        uint32_t n = inode_free[i];
+        pthread_mutex_unlock(&alloc_locks[i]);
+        if (n > most) {
+            best = i;
+            most = n;
+        }
+    }
+    return best;
+}
+
+// Take the lowest free inum of group, or of the next group that has one.
+// Return 0 if the inode table is full.
+uint32_t inode_manager::take_inode(uint32_t group) {
+    for (uint32_t k = 0; k < AG_COUNT; k++) {
+        uint32_t g = (group + k) % AG_COUNT;
+        uint32_t words = geo.ag_inodes / 64;
+        pthread_mutex_lock(&alloc_locks[g]);
+        uint32_t inum = 0;
+        for (uint32_t f = 0; f < full_words && inum == 0; f++) {
+            uint32_t left = words - f * 64;
+            uint64_t mask = left >= 64 ? ~0ULL : ~0ULL >> (64 - left);
+            uint64_t avail = ~inode_full[g * full_words + f] & mask;
+            if (avail == 0) continue;
+            uint32_t w = g * words + f * 64 + __builtin_ctzll(avail);
+            inum = w * 64 + __builtin_ctzll(~inode_used[w]);
+            mark_inode(inum, true);
+        }
+        pthread_mutex_unlock(&alloc_locks[g]);
+        if (inum) return inum;
+    }
+    return 0;
+}
+
+// Give back an inum taken by take_inode.
+void inode_manager::give_inode(uint32_t inum) {
+    pthread_mutex_t *l = &alloc_locks[inum / geo.ag_inodes];
+    pthread_mutex_lock(l);
+    mark_inode(inum, false);
+    pthread_mutex_unlock(l);
+}
+
+// Where the data of a file with no block yet goes: in the block group of
+// its inode group.
+blockid_t inode_manager::home_block(uint32_t inum) const {
+    return bm->group_start(inode_group(inum));
+}
+
+// Caller holds the lock. Return false if the inode could not be preserved
+// in the snapshot.
+bool inode_manager::init_inode(uint32_t inum, uint32_t type) {
+    if (!preserve(inum)) return false;
+    inode_t ino;
+    bzero(&ino, sizeof(ino));
+    ino.type = type;
+    ino.size = 0;
+    std::time_t time = std::time(NULL);
+    ino.ctime = time;
+    ino.atime = time;
+    ino.mtime = time;
+    put_inode(inum, &ino);
+    return true;
+}
+
+// Enter a file system operation on inum, and other if not 0: join a
+// journal transaction, then take the lock of their stripes, lowest first.
+// Leaving it returns the transaction to wait for if the operation must be
+// durable on return. Operations on files of different stripes run in
+// parallel.
+void inode_manager::op_begin(uint32_t inum, uint32_t other) {
+    uint32_t a = inum % INODE_LOCKS;
+    uint32_t b = other ? other % INODE_LOCKS : a;
+    bm->begin_op();
+    pthread_mutex_lock(&inode_locks[MIN(a, b)]);
+    if (a != b) pthread_mutex_lock(&inode_locks[MAX(a, b)]);
+}
+
+uint32_t inode_manager::op_end(uint32_t inum, uint32_t other) {
+    uint32_t a = inum % INODE_LOCKS;
+    uint32_t b = other ? other % INODE_LOCKS : a;
+    // with a journal, the blocks changed must be in the transaction
+    if (bm->journaled()) bc->flush();
+    uint32_t seq = bm->end_op();
+    if (a != b) pthread_mutex_unlock(&inode_locks[MAX(a, b)]);
+    pthread_mutex_unlock(&inode_locks[MIN(a, b)]);
+    return seq;
+}
+
+// Enter an operation on the whole store, once those on files have left.
+void inode_manager::op_begin_all() {
+    bm->begin_op();
+    for (int i = 0; i < INODE_LOCKS; i++) pthread_mutex_lock(&inode_locks[i]);
+}
+
+uint32_t inode_manager::op_end_all() {
+    if (bm->journaled()) bc->flush();
+    uint32_t seq = bm->end_op();
+    for (int i = INODE_LOCKS - 1; i >= 0; i--)
+        pthread_mutex_unlock(&inode_locks[i]);
+    return seq;
+}
+
+/* Create a new file.
+ * Return its inum. The commit is waited for, or left to the caller given
+ * seq, see finish_write. */
+uint32_t inode_manager::alloc_inode(uint32_t type, uint32_t parent,
+                                    uint32_t *seq) {
+    uint32_t inum = take_inode(pick_group(type, parent));
+    if (inum == 0) {
+        printf("!!! Failed to allocate an inode\n");
+        return 1;
+    }
+    op_begin(inum);
+    if (!init_inode(inum, type)) {
+        give_inode(inum);
+        op_end(inum);
+        printf("!!! Failed to allocate an inode\n");
+        return 1;
+    }
+    finish_write(inum, seq);
+    return inum;
+}
+
+/* Create up to n new files at once.
+ * Return their inums, fewer than n if the inode table is full. */
+std::vector<extent_protocol::extentid_t> inode_manager::alloc_ninode(
+    uint32_t type, int n, uint32_t parent) {
+    std::vector<extent_protocol::extentid_t> inumArray;
+    uint32_t seq = 0;
+    uint32_t group = pick_group(type, parent);
+    while (n-- > 0) {
+        uint32_t inum = take_inode(group);
+        if (inum == 0) break;
+        op_begin(inum);
+        if (!init_inode(inum, type)) {
+            give_inode(inum);
+            op_end(inum);
+            break;
+        }
+        seq = op_end(inum);
+        inumArray.push_back(inum);
+    }
+    // all of them usually end up in the same transaction
+    bm->wait_op(seq);
+    return inumArray;
+}
+
+/* Free inode inum: release its blocks, extent blocks included, clear it
+ * and give its inum back. Caller holds the lock. */
+void inode_manager::free_inode(uint32_t inum) {
+    inode_t *ino = get_inode(inum);
+    if (ino == NULL) return;
+    drop_pending(inum);
+    std::vector<extent_t> ext;
+    load_extents(inum, ino, ext);
+    truncate_extents(ext, 0);
+    store_extents(inum, ino, ext);
+    ino->type = 0;  // mark as deleted
+    ino->size = 0;
+    ino->mtime = std::time(NULL);
+    put_inode(inum, ino);
+    give_inode(inum);
+    free(ino);
+}
+
+/* Return an inode structure by inum, NULL otherwise.
+ * Caller should release the memory. */
+struct inode *inode_manager::get_inode(uint32_t inum) {
+    struct inode *ino = NULL, ino_disk;
+
+    // printf("\tim: get_inode %d\n", inum);
+
+    // if (inum < 0 || inum >= INODE_NUM) {
+    //     printf("\tim: inum out of range\n");
+    //     return NULL;
+    // }
+
+    buf_t *b = bc->bread(geo.iblock(inum));
+    bc->read(b, inum % geo.ipb * sizeof(inode_t), &ino_disk, sizeof(ino_disk));
+    bc->brelse(b);
+    if (ino_disk.type != 0) {
+        ino = (struct inode *)malloc(sizeof(struct inode));
+        *ino = ino_disk;
+    }
+    return ino;
+}
+
+void inode_manager::put_inode(uint32_t inum, struct inode *ino) {
+    // printf("\tim: put_inode %d\n", inum);
+    if (ino == NULL) return;
+
+    buf_t *b = bc->bread(geo.iblock(inum));
+    bc->write(b, inum % geo.ipb * sizeof(inode_t), ino, sizeof(*ino));
+    bc->brelse(b);
+}
+
+// Append extent e to ext, merging it with the last extent if it continues
+// it. A hole (start 0) merges with a hole.
+static void append_extent(std::vector<extent_t> &ext, extent_t e) {
+    if (!ext.empty()) {
+        extent_t &last = ext.back();
+        if (last.start == 0 ? e.start == 0 : last.start + last.len == e.start) {
+            last.len += e.len;
+            return;
+        }
+    }
+    ext.push_back(e);
+}
+
+static bool in_extents(const std::vector<extent_t> &ext, blockid_t b) {
+    for (const extent_t &e : ext)
+        if (e.start && b >= e.start && b < e.start + e.len) return true;
+    return false;
+}
+
+// Whether a block of bs bytes is all zeros, see with_block_size.
+template <class BS>
+static bool block_zero(const char *blk, BS bs) {
+    const uint64_t *w = (const uint64_t *)blk;
+    for (size_t i = 0; i < bs / sizeof(uint64_t); i++)
+        if (w[i]) return false;
+    return true;
+}
+
+// Physical runs backing logical blocks [first, first + n) of a file, holes
+// having a start of 0.
+static void resolve_extents(const std::vector<extent_t> &ext, uint32_t first,
+                            uint32_t n, std::vector<extent_t> &runs) {
+    uint32_t pos = 0, end = first + n;
+    for (const extent_t &e : ext) {
+        if (pos >= end) break;
+        uint32_t lo = MAX(pos, first), hi = MIN(pos + e.len, end);
+        if (lo < hi)
+            runs.push_back({e.start ? e.start + (lo - pos) : 0, hi - lo});
+        pos += e.len;
+    }
+}
+
+// Whether logical blocks [first, first + n) are all holes.
+static bool all_holes(const std::vector<extent_t> &ext, uint32_t first,
+                      uint32_t n) {
+    std::vector<extent_t> runs;
+    resolve_extents(ext, first, n, runs);
+    for (const extent_t &r : runs)
+        if (r.start) return false;
+    return true;
+}
+
+/* Get all the data of a file by inum, alloced, to be freed by the caller.
+ * Return 0, -ENOENT if the file does not exist or -EIO if a block of it
+ * does not match its checksum, and then no data. */
+int inode_manager::read_file(uint32_t inum, char **buf_out, int *size,
+                             bool snap) {
+    op_begin(inum);
+    uint32_t key = inum;
+    inode_t *ino = snap ? get_snap_inode(inum, key) : get_inode(inum);
+    if (ino == NULL) {
+        printf("ERR! inode %d not found\n", inum);
+        op_end(inum);
+        return -ENOENT;
+    }
+    *size = ino->size;
+    int nblk = geo.nblk(ino->size);
+    char *tmp = (char *)malloc((size_t)nblk * geo.block_size);
+    if (inode_inline(ino)) {
+        memcpy(tmp, ino->data, ino->size);
+    } else {
+        // one copy per extent
+        std::vector<extent_t> ext;
+        load_extents(key, ino, ext);
+        char *p = tmp;
+        bool ok = true;
+        for (const extent_t &e : ext) {
+            if (e.start)
+                ok = bm->read_blocks(e.start, e.len, p) && ok;
+            else
+                bzero(p, (size_t)e.len * geo.block_size);
+            p += (size_t)e.len * geo.block_size;
+        }
+        if (!ok) {
+            op_end(inum);
+            free(ino);
+            free(tmp);
+            *size = 0;
+            return -EIO;
+        }
+        if (!snap) read_pending(inum, 0, ino->size, tmp);
+    }
+    *buf_out = tmp;
+    // udpate metadata, a snapshot is read-only
+    if (!snap) {
+        ino->atime = (unsigned int)std::time(NULL);
+        put_inode(inum, ino);
+    }
+    op_end(inum);
+    free(ino);
+    return 0;
+}
+
+// End a write to inum, and wait for its commit, or given seq return it
+// there for the caller to wait_op on once it has let go of its own locks.
+void inode_manager::finish_write(uint32_t inum, uint32_t *seq) {
+    uint32_t s = op_end(inum);
+    if (seq)
+        *seq = s;
+    else
+        bm->wait_op(s);
+}
+
+/* alloc/free blocks if needed, blocks of zeros are left as holes.
+ * Return 0, -ENOENT if the file does not exist or -ENOSPC if there is no
+ * room for the data. Given seq, the commit is not waited for, see
+ * finish_write. */
+int inode_manager::write_file(uint32_t inum, const char *buf, int size,
+                              uint32_t *seq) {
+    op_begin(inum);
+    inode_t *ino = get_inode(inum);
+    if (ino == NULL) {
+        printf("ERR! inode %d not found\n", inum);
+        op_end(inum);
+        return -ENOENT;
+    }
+    if (!preserve(inum)) {
+        op_end(inum);
+        free(ino);
+        return -ENOSPC;
+    }
+    // A small file goes inline, whatever it was before
+    int o_blk_num = inode_inline(ino) ? 0 : geo.nblk(ino->size);
+    int new_blk_num = size <= (int)INLINE_SIZE ? 0 : geo.nblk(size);
+    // Make a copy of data, when accessing this data as multiple block size
+    // blocks, it's possible to access past the boundary of memory, leading to
+    // segmentation fault
+    char *copy = (char *)calloc(geo.nblk(size), geo.block_size);
+    memcpy(copy, buf, size);
+    buf = copy;
+    std::vector<extent_t> ext, fresh, old;
+    load_extents(inum, ino, ext);
+    bool ok;
+    bool rebuilt = dedup || shares_blocks(ext);
+    bool delay = !rebuilt && delalloc;
+    std::vector<uint32_t> delayed;
+    int64_t more = 0;
+    bool reserved = false;
+    if (rebuilt) {
+        // The file gets blocks of its own, or with dedup on blocks that
+        // already hold the same data, and the old ones are released once
+        // the new ones are in place.
+        old.swap(ext);
+        ok = dedup_fill(inum, ext, buf, new_blk_num, fresh);
+    } else {
+        if (new_blk_num > o_blk_num)
+            append_extent(ext, {0, (uint32_t)(new_blk_num - o_blk_num)});
+        // the data for the holes waits for its blocks, which are reserved
+        // first: the pending data of before gives its reservation back
+        ok = true;
+        if (delay) {
+            std::vector<extent_t> runs;
+            resolve_extents(ext, 0, new_blk_num, runs);
+            with_block_size(geo.block_size, [&](auto bs) {
+                uint32_t pos = 0;
+                for (const extent_t &r : runs) {
+                    for (uint32_t b = pos; r.start == 0 && b < pos + r.len;
+                         b++)
+                        if (!block_zero(buf + (size_t)b * bs, bs))
+                            delayed.push_back(b);
+                    pos += r.len;
+                }
+            });
+            more = (int64_t)delay_cost(delayed.size()) -
+                   delay_cost(pending_blocks(inum));
+            reserved = more > 0 && bm->reserve(more);
+            ok = more <= 0 || reserved;
+        }
+        if (ok && new_blk_num < o_blk_num) truncate_extents(ext, new_blk_num);
+        if (ok && !delay) ok = fill_holes(inum, ext, 0, new_blk_num, fresh, buf);
+    }
+    if (ok && !store_extents(inum, ino, ext)) {
+        truncate_extents(fresh, 0);
+        ok = false;
+    }
+    if (!ok) {
+        if (reserved) bm->unreserve(more);
+        printf("ERR! no space left for inode %d\n", inum);
+        op_end(inum);
+        free(copy);
+        free(ino);
+        return -ENOSPC;
+    }
+    if (delay) {
+        drop_pending(inum, false);
+        if (more < 0) bm->unreserve(-more);
+        for (uint32_t b : delayed)
+            delay_blocks(inum, b * geo.block_size,
+                         buf + (size_t)b * geo.block_size, geo.block_size);
+    } else {
+        drop_pending(inum);
+    }
+    // Write new file data, one copy per extent
+    for (const extent_t &e : ext) {
+        if (e.start && !rebuilt) bm->write_blocks(e.start, e.len, buf);
+        buf += (size_t)e.len * geo.block_size;
+    }
+    truncate_extents(old, 0);
+    if (new_blk_num == 0 && size > 0) {
+        // store_extents cleared the extent area
+        ino->nextents = INLINE_EXTENTS;
+        memcpy(ino->data, buf, size);
+    }
+    // update metadata
+    ino->size = size;
+    std::time_t time = std::time(NULL);
+    ino->atime = time;
+    ino->mtime = time;
+    ino->ctime = time;
+
+    // write back inode
+    put_inode(inum, ino);
+    if (pending_blocks(inum) > DELALLOC_FILE) flush_file(inum, ino);
+    finish_write(inum, seq);
+    free(copy);
+    free(ino);
+    if (npending > DELALLOC_MAX) flush_pending();
+    return 0;
+}
+
+
+/* Read up to len bytes at offset off of a file into buf, only touching the
+ * blocks that cover them. Return the number of bytes read, -ENOENT if the
+ * file does not exist or -EIO if a block read does not match its
+ * checksum. */
+int inode_manager::read_range(uint32_t inum, uint32_t off, uint32_t len,
+                              char *buf, bool snap) {
+    op_begin(inum);
+    uint32_t key = inum;
+    inode_t *ino = snap ? get_snap_inode(inum, key) : get_inode(inum);
+    if (ino == NULL) {
+        printf("ERR! inode %d not found\n", inum);
+        op_end(inum);
+        return -ENOENT;
+    }
+    if (off >= ino->size) len = 0;
+    len = MIN(len, ino->size - off);
+    if (len > 0 && inode_inline(ino)) {
+        memcpy(buf, ino->data + off, len);
+    } else if (len > 0) {
+        uint32_t first = off >> geo.shift;
+        uint32_t last = (off + len - 1) >> geo.shift;
+        std::vector<extent_t> ext, runs;
+        load_extents(key, ino, ext);
+        resolve_extents(ext, first, last - first + 1, runs);
+        // whole blocks go straight to buf, partial ones through blk
+        char blk[BLOCK_SIZE_MAX];
+        bool ok = true;
+        with_block_size(geo.block_size, [&](auto bs) {
+            uint64_t cur = off, end = (uint64_t)off + len;
+            uint64_t run_begin = (uint64_t)first * bs;
+            for (const extent_t &r : runs) {
+                uint64_t run_end = run_begin + (uint64_t)r.len * bs;
+                while (cur < end && cur < run_end) {
+                    blockid_t bid = r.start + (cur - run_begin) / bs;
+                    uint32_t boff = cur % bs;
+                    if (r.start == 0) {
+                        // a hole reads as zeros
+                        uint32_t n = MIN(run_end, end) - cur;
+                        bzero(buf + (cur - off), n);
+                        cur += n;
+                    } else if (boff == 0 && end - cur >= bs) {
+                        uint32_t n =
+                            MIN((end - cur) / bs, (run_end - cur) / bs);
+                        ok = bm->read_blocks(bid, n, buf + (cur - off)) && ok;
+                        cur += (uint64_t)n * bs;
+                    } else {
+                        uint32_t n = MIN(bs - boff, end - cur);
+                        ok = bm->read_block(bid, blk) && ok;
+                        memcpy(buf + (cur - off), blk + boff, n);
+                        cur += n;
+                    }
+                }
+                run_begin = run_end;
+            }
+        });
+        if (!ok) {
+            op_end(inum);
+            free(ino);
+            return -EIO;
+        }
+        if (!snap) read_pending(inum, off, len, buf);
+    }
+    if (!snap) {
+        ino->atime = std::time(NULL);
+        put_inode(inum, ino);
+    }
+    op_end(inum);
+    free(ino);
+    return len;
+}
+
+/* Overwrite len bytes at offset off of a file with buf, growing the file if
+ * they go past its end. Only the blocks covering [off, off + len) are
+ * written, and only the holes among them are allocated: a gap past the old
+ * end is left as a hole. Return the number of bytes written, -ENOENT if the
+ * file does not exist, -EFBIG if it would grow past 4 GiB or -ENOSPC if
+ * there is no room for the data. Given seq, the commit is not waited for,
+ * see finish_write. */
+int inode_manager::write_range(uint32_t inum, uint32_t off, const char *buf,
+                               uint32_t len, uint32_t *seq) {
+    op_begin(inum);
+    inode_t *ino = get_inode(inum);
+    if (ino == NULL) {
+        printf("ERR! inode %d not found\n", inum);
+        op_end(inum);
+        return -ENOENT;
+    }
+    uint64_t end = (uint64_t)off + len;
+    if (end > UINT_MAX || !preserve(inum)) {
+        op_end(inum);
+        free(ino);
+        return end > UINT_MAX ? -EFBIG : -ENOSPC;
+    }
+    uint32_t o_blk_num = geo.nblk(ino->size);
+    uint32_t new_size = MAX(ino->size, (uint32_t)end);
+    uint32_t new_blk_num = geo.nblk(new_size);
+    if (new_size > 0 && new_size <= INLINE_SIZE &&
+        (inode_inline(ino) || ino->size == 0)) {
+        // the extent area of an empty file is all zeros
+        ino->nextents = INLINE_EXTENTS;
+        memcpy(ino->data + off, buf, len);
+        ino->size = new_size;
+        std::time_t time = std::time(NULL);
+        ino->mtime = time;
+        ino->ctime = time;
+        put_inode(inum, ino);
+        finish_write(inum, seq);
+        free(ino);
+        return len;
+    }
+    std::vector<extent_t> ext, fresh;
+    bool promoted = inode_inline(ino);
+    if (promoted) {
+        if (!promote_inline(inum, ino, ext)) {
+            printf("ERR! no space left for inode %d\n", inum);
+            op_end(inum);
+            free(ino);
+            return -ENOSPC;
+        }
+    } else {
+        load_extents(inum, ino, ext);
+    }
+    // The file grows by a hole, then only the blocks covering
+    // [off, off + len) are allocated.
+    if (new_blk_num > o_blk_num)
+        append_extent(ext, {0, new_blk_num - o_blk_num});
+    uint32_t first = off >> geo.shift;
+    uint32_t nblk = len ? ((end - 1) >> geo.shift) - first + 1 : 0;
+    bool holes = all_holes(ext, first, nblk);
+    if (!promoted && delalloc && !dedup && len > 0 && holes) {
+        // the data waits for its blocks, see flush_file, which are reserved
+        // now so that it is not accepted if there will be no room for it
+        uint32_t more = more_pending(inum, first, nblk);
+        bool reserved = bm->reserve(more);
+        if (!reserved ||
+            (new_blk_num > o_blk_num && !store_extents(inum, ino, ext))) {
+            if (reserved) bm->unreserve(more);
+            printf("ERR! no space left for inode %d\n", inum);
+            op_end(inum);
+            free(ino);
+            return -ENOSPC;
+        }
+        delay_blocks(inum, off, buf, len);
+        ino->size = new_size;
+        std::time_t time = std::time(NULL);
+        ino->mtime = time;
+        ino->ctime = time;
+        put_inode(inum, ino);
+        if (pending_blocks(inum) > DELALLOC_FILE) flush_file(inum, ino);
+        finish_write(inum, seq);
+        free(ino);
+        if (npending > DELALLOC_MAX) flush_pending();
+        return len;
+    }
+    if (pending_blocks(inum)) {
+        // written in place below, the pending data goes first
+        flush_file(inum, ino);
+        load_extents(inum, ino, ext);
+        if (new_blk_num > o_blk_num)
+            append_extent(ext, {0, new_blk_num - o_blk_num});
+    }
+    std::vector<extent_t> copies, shared;
+    bool ok = unshare(inum, ext, first, nblk, copies, shared) &&
+              fill_holes(inum, ext, first, nblk, fresh);
+    if (ok && (new_blk_num > o_blk_num || !fresh.empty() || promoted ||
+               !copies.empty()) &&
+        !store_extents(inum, ino, ext))
+        ok = false;
+    if (!ok) {
+        truncate_extents(fresh, 0);
+        truncate_extents(copies, 0);
+        if (promoted) bm->free_block(ext[0].start);
+        printf("ERR! no space left for inode %d\n", inum);
+        op_end(inum);
+        free(ino);
+        return -ENOSPC;
+    }
+    // Newly allocated blocks start out as zeros around buf.
+    char blk[BLOCK_SIZE_MAX];
+    std::vector<extent_t> runs;
+    resolve_extents(ext, first, nblk, runs);
+    with_block_size(geo.block_size, [&](auto bs) {
+        uint64_t cur = off;
+        uint64_t run_begin = (uint64_t)first * bs;
+        for (const extent_t &r : runs) {
+            uint64_t run_end = run_begin + (uint64_t)r.len * bs;
+            while (cur < end && cur < run_end) {
+                blockid_t bid = r.start + (cur - run_begin) / bs;
+                uint32_t boff = cur % bs;
+                if (boff == 0 && end - cur >= bs) {
+                    uint32_t n = MIN((end - cur) / bs, (run_end - cur) / bs);
+                    bm->write_blocks(bid, n, buf + (cur - off));
+                    cur += (uint64_t)n * bs;
+                } else {
+                    uint32_t n = MIN(bs - boff, end - cur);
+                    if (in_extents(fresh, bid))
+                        bzero(blk, bs);
+                    else
+                        bm->read_block(bid, blk);
+                    memcpy(blk + boff, buf + (cur - off), n);
+                    bm->write_block(bid, blk);
+                    cur += n;
+                }
+            }
+            run_begin = run_end;
+        }
+    });
+    truncate_extents(shared, 0);
+    ino->size = new_size;
+    std::time_t time = std::time(NULL);
+    ino->mtime = time;
+    ino->ctime = time;
+    put_inode(inum, ino);
+    finish_write(inum, seq);
+    free(ino);
+    return len;
+}
+
+// Make everything written so far durable (no-op for an in-memory disk),
+// pending data included.
+void inode_manager::sync() {
+    flush_pending();
+    bc->flush();
+    bm->sync();
+}
+
+// Read the attributes straight from the cached inode table block, or
+// those of the snapshot if snap.
+void inode_manager::getattr(uint32_t inum, extent_protocol::attr &a,
+                            bool snap) {
+    inode_t ino;
+    if (snap) {
+        uint32_t key;
+        pthread_mutex_lock(&inode_locks[inum % INODE_LOCKS]);
+        inode_t *s = get_snap_inode(inum, key);
+        pthread_mutex_unlock(&inode_locks[inum % INODE_LOCKS]);
+        ino.type = 0;
+        if (s) ino = *s;
+        free(s);
+    } else {
+        buf_t *b = bc->bread(geo.iblock(inum));
+        bc->read(b, inum % geo.ipb * sizeof(inode_t), &ino, sizeof(ino));
+        bc->brelse(b);
+    }
+    a.type = ino.type;
+    if (ino.type != 0) {
+        a.atime = ino.atime;
+        a.mtime = ino.mtime;
+        a.ctime = ino.ctime;
+        a.size = ino.size;
+    }
+}
+
+// As for alloc_inode given seq.
+void inode_manager::remove_file(uint32_t inum, uint32_t *seq) {
+    op_begin(inum);
+    inode_t *ino = get_inode(inum);
+    if (ino == NULL) {
+        printf("ERR! remove_file: inum not exist\n");
+        op_end(inum);
+        return;
+    }
+    if (!preserve(inum)) {
+        op_end(inum);
+        free(ino);
+        return;
+    }
+    free_inode(inum);
+    finish_write(inum, seq);
+    free(ino);
+    return;
+}
+
+/* Create a file sharing the blocks of file src, which are then copied on
+ * write by either file. Return its inum, 0 on error. */
+uint32_t inode_manager::clone_file(uint32_t src) {
+    uint32_t inum = take_inode(inode_group(src));
+    if (inum == 0) {
+        printf("!!! Failed to allocate an inode\n");
+        return 0;
+    }
+    op_begin(src, inum);
+    inode_t *ino = get_inode(src);
+    bool ok = ino != NULL && preserve(inum);
+    if (ok) {
+        // the clone shares the blocks of the pending data too
+        flush_file(src, ino);
+        inode_t copy = *ino;
+        std::vector<extent_t> ext;
+        load_extents(src, ino, ext);
+        std::time_t time = std::time(NULL);
+        copy.atime = time;
+        copy.mtime = time;
+        copy.ctime = time;
+        if (!inode_inline(&copy)) {
+            // the clone gets extent blocks of its own
+            copy.nextents = 0;
+            copy.extent_blocks = 0;
+            share_blocks(ext);
+            ok = store_extents(inum, &copy, ext);
+            if (!ok) truncate_extents(ext, 0);
+        }
+        if (ok) put_inode(inum, &copy);
+    }
+    free(ino);
+    if (!ok) {
+        printf("ERR! clone_file: cannot clone inode %d\n", src);
+        give_inode(inum);
+        op_end(src, inum);
+        return 0;
+    }
+    bm->wait_op(op_end(src, inum));
+    return inum;
+}
+
+// A snapshot is a frozen view of every file, taken in constant time: an
+// inode is only copied to the snapshot the first time it changes after it,
+// and the copy shares its data blocks, which the file then copies on write.
+// There is one snapshot at a time.
+bool inode_manager::take_snapshot() {
+    op_begin_all();
+    // data written before the snapshot gets its blocks before it
+    for (uint32_t s = 0; s < INODE_LOCKS; s++) flush_stripe(s);
+    pthread_mutex_lock(&snap_lock);
+    bool ok = bm->sb.snap_table[0] == 0;
+    std::vector<blockid_t> ids(geo.snap_table_blocks + geo.snap_index_blocks);
+    if (ok) ok = bm->alloc_blocks(ids.size(), ids.data());
+    if (ok) {
+        snap_table.assign(ids.begin(), ids.begin() + geo.snap_table_blocks);
+        snap_index.assign(ids.begin() + geo.snap_table_blocks, ids.end());
+        char zeros[BLOCK_SIZE_MAX];
+        bzero(zeros, sizeof(zeros));
+        for (blockid_t t : snap_table) {
+            buf_t *b = bc->bget(t);
+            bc->write(b, 0, zeros, geo.block_size);
+            bc->brelse(b);
+        }
+        // the index blocks list the table blocks, the last one zero-padded
+        const uint32_t per_block = geo.block_size / sizeof(blockid_t);
+        for (uint32_t i = 0; i < snap_index.size(); i++) {
+            uint32_t n = MIN(per_block, snap_table.size() - i * per_block);
+            buf_t *b = bc->bget(snap_index[i]);
+            bc->write(b, 0, zeros, geo.block_size);
+            bc->write(b, 0, &snap_table[i * per_block], n * sizeof(blockid_t));
+            bc->brelse(b);
+        }
+        snap_copies.assign(geo.itable_blocks, 0);
+        const std::vector<blockid_t> &top =
+            snap_index.empty() ? snap_table : snap_index;
+        bzero(bm->sb.snap_table, sizeof(bm->sb.snap_table));
+        std::copy(top.begin(), top.end(), bm->sb.snap_table);
+        bm->sb.snap_time = std::time(NULL);
+        bm->write_super();
+    }
+    pthread_mutex_unlock(&snap_lock);
+    bm->wait_op(op_end_all());
+    if (!ok) printf("ERR! take_snapshot: there is a snapshot or no room\n");
+    return ok;
+}
+
+// Delete the snapshot, releasing the blocks only it refers to.
+bool inode_manager::drop_snapshot() {
+    op_begin_all();
+    pthread_mutex_lock(&snap_lock);
+    bool ok = bm->sb.snap_table[0] != 0;
+    for (uint32_t t = 0; ok && t < snap_copies.size(); t++) {
+        if (snap_copies[t] == 0) continue;
+        inode_t slots[IPB_MAX];
+        buf_t *b = bc->bread(snap_copies[t]);
+        bc->read(b, 0, slots, geo.ipb * sizeof(inode_t));
+        bc->brelse(b);
+        for (uint32_t i = 0; i < geo.ipb; i++) {
+            if (slots[i].type == 0 || slots[i].type == SNAP_UNCHANGED)
+                continue;
+            uint32_t key = SNAP_INUM(t * geo.ipb + i);
+            std::vector<extent_t> ext;
+            load_extents(key, &slots[i], ext);
+            truncate_extents(ext, 0);
+            store_extents(key, &slots[i], ext);
+        }
+        bc->forget(snap_copies[t]);
+        bm->free_block(snap_copies[t]);
+    }
+    if (ok) {
+        for (blockid_t t : snap_table) {
+            bc->forget(t);
+            bm->free_block(t);
+        }
+        for (blockid_t t : snap_index) {
+            bc->forget(t);
+            bm->free_block(t);
+        }
+        snap_copies.clear();
+        snap_table.clear();
+        snap_index.clear();
+        bzero(bm->sb.snap_table, sizeof(bm->sb.snap_table));
+        bm->sb.snap_time = 0;
+        bm->write_super();
+    }
+    pthread_mutex_unlock(&snap_lock);
+    bm->wait_op(op_end_all());
+    return ok;
+}
+
+// Read the snapshot table of a mounted image.
+void inode_manager::load_snapshot() {
+    snap_copies.clear();
+    snap_table.clear();
+    snap_index.clear();
+    if (bm->sb.snap_table[0] == 0) return;
+    const uint32_t per_block = geo.block_size / sizeof(blockid_t);
+    if (geo.snap_index_blocks == 0) {
+        snap_table.assign(bm->sb.snap_table,
+                          bm->sb.snap_table + geo.snap_table_blocks);
+    } else {
+        snap_index.assign(bm->sb.snap_table,
+                          bm->sb.snap_table + geo.snap_index_blocks);
+        snap_table.resize(geo.snap_table_blocks);
+        for (uint32_t i = 0; i < snap_index.size(); i++) {
+            uint32_t n = MIN(per_block, snap_table.size() - i * per_block);
+            buf_t *b = bc->bread(snap_index[i]);
+            bc->read(b, 0, &snap_table[i * per_block], n * sizeof(blockid_t));
+            bc->brelse(b);
+        }
+    }
+    snap_copies.resize(geo.itable_blocks);
+    for (uint32_t i = 0; i < snap_table.size(); i++) {
+        // the last block may be partly used
+        uint32_t n = MIN(per_block, geo.itable_blocks - i * per_block);
+        buf_t *b = bc->bread(snap_table[i]);
+        bc->read(b, 0, &snap_copies[i * per_block], n * sizeof(blockid_t));
+        bc->brelse(b);
+    }
+}
+
+// Copy inode inum to the snapshot before it changes, unless it already
+// was. Caller holds the lock of inum. Return false if there is no room
+// for the copy.
+bool inode_manager::preserve(uint32_t inum) {
+    pthread_mutex_lock(&snap_lock);
+    if (snap_copies.empty()) {
+        pthread_mutex_unlock(&snap_lock);
+        return true;
+    }
+    uint32_t t = inum / geo.ipb;
+    size_t off = inum % geo.ipb * sizeof(inode_t);
+    blockid_t c = snap_copies[t];
+    if (c == 0) {
+        // every slot of a new copy block starts out unchanged
+        if (!bm->alloc_blocks(1, &c)) {
+            pthread_mutex_unlock(&snap_lock);
+            printf("ERR! no room to preserve inode %d\n", inum);
+            return false;
+        }
+        inode_t slots[IPB_MAX];
+        bzero(slots, geo.ipb * sizeof(inode_t));
+        for (uint32_t i = 0; i < geo.ipb; i++) slots[i].type = SNAP_UNCHANGED;
+        buf_t *b = bc->bget(c);
+        bc->write(b, 0, slots, geo.ipb * sizeof(inode_t));
+        bc->brelse(b);
+        snap_copies[t] = c;
+        const uint32_t per_block = geo.block_size / sizeof(blockid_t);
+        b = bc->bread(snap_table[t / per_block]);
+        bc->write(b, t % per_block * sizeof(blockid_t), &c, sizeof(c));
+        bc->brelse(b);
+    }
+    pthread_mutex_unlock(&snap_lock);
+    inode_t ino;
+    buf_t *b = bc->bread(c);
+    bc->read(b, off, &ino, sizeof(ino));
+    bc->brelse(b);
+    if (ino.type != SNAP_UNCHANGED) return true;
+    b = bc->bread(geo.iblock(inum));
+    bc->read(b, off, &ino, sizeof(ino));
+    bc->brelse(b);
+    if (ino.type != 0 && !inode_inline(&ino)) {
+        // the copy gets extent blocks of its own
+        std::vector<extent_t> ext;
+        load_extents(inum, &ino, ext);
+        ino.nextents = 0;
+        ino.extent_blocks = 0;
+        if (!store_extents(SNAP_INUM(inum), &ino, ext)) {
+            printf("ERR! no room to preserve inode %d\n", inum);
+            return false;
+        }
+        share_blocks(ext);
+    }
+    b = bc->bread(c);
+    bc->write(b, off, &ino, sizeof(ino));
+    bc->brelse(b);
+    return true;
+}
+
+// The inode inum had when the snapshot was taken, NULL if it did not
+// exist. key is set to the map cache key of its extents. Caller holds the
+// lock of inum and should release the memory.
+inode_t *inode_manager::get_snap_inode(uint32_t inum, uint32_t &key) {
+    key = inum;
+    pthread_mutex_lock(&snap_lock);
+    bool taken = !snap_copies.empty();
+    blockid_t c = taken ? snap_copies[inum / geo.ipb] : 0;
+    pthread_mutex_unlock(&snap_lock);
+    if (!taken) return NULL;
+    inode_t ino;
+    ino.type = SNAP_UNCHANGED;
+    if (c) {
+        buf_t *b = bc->bread(c);
+        bc->read(b, inum % geo.ipb * sizeof(inode_t), &ino, sizeof(ino));
+        bc->brelse(b);
+    }
+    if (ino.type == SNAP_UNCHANGED) return get_inode(inum);
+    key = SNAP_INUM(inum);
+    if (ino.type == 0) return NULL;
+    inode_t *copy = (inode_t *)malloc(sizeof(inode_t));
+    *copy = ino;
+    return copy;
+}
+
+// Read the extents held in the extent block chain of a file.
+void inode_manager::load_chain(const inode_t *ino, extent_map_t &m) const {
+    m.ext.assign(ino->extents, ino->extents + MIN(ino->nextents, NEXTENT));
+    m.chain.clear();
+    extent_block_t eb;
+    for (blockid_t id = ino->extent_blocks; id != 0; id = eb.next) {
+        // a corrupt chain is cut short here, and repaired by fsck
+        if (id >= bm->sb.nblocks || m.chain.size() > ino->nextents / geo.epb)
+            break;
+        m.chain.push_back(id);
+        buf_t *b = bc->bread(id);
+        bc->read(b, 0, &eb, geo.block_size);
+        bc->brelse(b);
+        m.ext.insert(m.ext.end(), eb.extents,
+                     eb.extents + MIN(eb.count, geo.epb));
+    }
+}
+
+// Get the extent list of a file. Files with extent blocks have their map
+// cached, so the chain is only walked on the first access.
+void inode_manager::load_extents(uint32_t inum, const inode_t *ino,
+                                 std::vector<extent_t> &ext) {
+    if (inode_inline(ino)) {
+        ext.clear();
+        return;
+    }
+    if (ino->extent_blocks == 0) {
+        ext.assign(ino->extents, ino->extents + ino->nextents);
+        return;
+    }
+    pthread_mutex_lock(&map_lock);
+    auto it = map_cache.find(inum);
+    if (it != map_cache.end()) {
+        ext = it->second.m.ext;
+        map_lru.splice(map_lru.begin(), map_lru, it->second.pos);
+        pthread_mutex_unlock(&map_lock);
+        return;
+    }
+    pthread_mutex_unlock(&map_lock);
+    extent_map_t m;
+    load_chain(ino, m);
+    ext = m.ext;
+    cache_map(inum, std::move(m));
+}
+
+// Write the extent list back, reusing the extent blocks the file already
+// has and allocating or freeing some as the list grows or shrinks. Only the
+// extent blocks whose contents change are written.
+// Return false if there is no room for the new extent blocks.
+bool inode_manager::store_extents(uint32_t inum, inode_t *ino,
+                                  const std::vector<extent_t> &ext) {
+    if (ext.size() >= INLINE_EXTENTS) return false;
+    extent_map_t old;
+    pthread_mutex_lock(&map_lock);
+    auto it = map_cache.find(inum);
+    bool cached = it != map_cache.end();
+    if (cached) {
+        old = std::move(it->second.m);
+        map_lru.erase(it->second.pos);
+        map_cache.erase(it);
+    }
+    pthread_mutex_unlock(&map_lock);
+    if (!cached && !inode_inline(ino) && ino->extent_blocks != 0)
+        load_chain(ino, old);
+    std::vector<blockid_t> chain = old.chain;
+    uint32_t nspill = ext.size() > NEXTENT ? ext.size() - NEXTENT : 0;
+    uint32_t need = (nspill + geo.epb - 1) / geo.epb;
+    if (chain.size() < need) {
+        uint32_t have = chain.size();
+        chain.resize(need);
+        if (!bm->alloc_blocks(need - have, &chain[have], home_block(inum))) {
+            if (old.chain.size()) cache_map(inum, std::move(old));
+            return false;
+        }
+    }
+    for (uint32_t i = need; i < chain.size(); i++) {
+        bc->forget(chain[i]);
+        bm->free_block(chain[i]);
+    }
+    chain.resize(need);
+
+    ino->nextents = ext.size();
+    bzero(ino->extents, sizeof(ino->extents));
+    std::copy(ext.begin(), ext.begin() + MIN(ext.size(), NEXTENT),
+              ino->extents);
+    ino->extent_blocks = need ? chain[0] : 0;
+    uint32_t old_nspill = old.ext.size() > NEXTENT ? old.ext.size() - NEXTENT : 0;
+    extent_block_t eb;
+    for (uint32_t i = 0; i < need; i++) {
+        uint32_t first = NEXTENT + i * geo.epb;
+        uint32_t count = MIN(nspill - i * geo.epb, geo.epb);
+        blockid_t next = i + 1 < need ? chain[i + 1] : 0;
+        if (i < old.chain.size()) {
+            // skip the block if its successor and extents are unchanged
+            blockid_t old_next = i + 1 < old.chain.size() ? old.chain[i + 1] : 0;
+            uint32_t old_count = MIN(old_nspill - i * geo.epb, geo.epb);
+            if (next == old_next && count == old_count &&
+                memcmp(&ext[first], &old.ext[first],
+                       count * sizeof(extent_t)) == 0)
+                continue;
+        }
+        bzero(&eb, sizeof(eb));
+        eb.next = next;
+        eb.count = count;
+        std::copy(ext.begin() + first, ext.begin() + first + count,
+                  eb.extents);
+        buf_t *b = bc->bget(chain[i]);
+        bc->write(b, 0, &eb, geo.block_size);
+        bc->brelse(b);
+    }
+    if (need) cache_map(inum, {ext, chain});
+    return true;
+}
+
+// Remember the extent map of inum, making room for it if needed.
+void inode_manager::cache_map(uint32_t inum, extent_map_t &&m) {
+    pthread_mutex_lock(&map_lock);
+    if (map_cache_size) {
+        uncache_map(inum);
+        if (map_cache.size() >= map_cache_size) uncache_map(map_lru.back());
+        map_lru.push_front(inum);
+        map_cache[inum] = {std::move(m), map_lru.begin()};
+    }
+    pthread_mutex_unlock(&map_lock);
+}
+
+// Forget the extent map of inum, the caller holds map_lock.
+void inode_manager::uncache_map(uint32_t inum) {
+    auto it = map_cache.find(inum);
+    if (it == map_cache.end()) return;
+    map_lru.erase(it->second.pos);
+    map_cache.erase(it);
+}
+
+// Count the references to every data block, and with index, add every
+// data block to the dedup index.
+void inode_manager::scan_blocks(bool index) {
+    std::unordered_map<blockid_t, uint32_t> refs;
+    for (uint32_t inum = 1; inum < bm->sb.ninodes; inum++) {
+        if (!(inode_used[inum / 64] & (1ULL << (inum % 64)))) continue;
+        inode_t *ino = get_inode(inum);
+        if (ino == NULL) continue;
+        std::vector<extent_t> ext;
+        load_extents(inum, ino, ext);
+        free(ino);
+        for (const extent_t &e : ext)
+            for (uint32_t i = 0; e.start && i < e.len; i++) {
+                if (e.start + i >= bm->sb.nblocks) break;
+                refs[e.start + i]++;
+            }
+    }
+    // the copies in the snapshot hold references too
+    for (uint32_t t = 0; t < snap_copies.size(); t++) {
+        if (snap_copies[t] == 0) continue;
+        inode_t slots[IPB_MAX];
+        buf_t *b = bc->bread(snap_copies[t]);
+        bc->read(b, 0, slots, geo.ipb * sizeof(inode_t));
+        bc->brelse(b);
+        for (uint32_t i = 0; i < geo.ipb; i++) {
+            if (slots[i].type == 0 || slots[i].type == SNAP_UNCHANGED)
+                continue;
+            std::vector<extent_t> ext;
+            load_extents(SNAP_INUM(t * geo.ipb + i), &slots[i], ext);
+            for (const extent_t &e : ext)
+                for (uint32_t k = 0; e.start && k < e.len; k++) {
+                    if (e.start + k >= bm->sb.nblocks) break;
+                    refs[e.start + k]++;
+                }
+        }
+    }
+    pthread_mutex_lock(&share_lock);
+    block_refs.clear();
+    for (auto &r : refs)
+        if (r.second > 1) block_refs[r.first] = r.second;
+    pthread_mutex_unlock(&share_lock);
+    if (index)
+        for (auto &r : refs) index_block(r.first, bm->block_crc(r.first));
+}
+
+// Add block b, holding data of CRC32C crc, to the dedup index unless a
+// block with the same CRC is there already.
+void inode_manager::index_block(blockid_t b, uint32_t crc) {
+    pthread_mutex_lock(&share_lock);
+    if (fp_index.insert({crc, b}).second) block_fp[b] = crc;
+    pthread_mutex_unlock(&share_lock);
+}
+
+// Drop block b from the dedup index. Called with share_lock held.
+void inode_manager::unindex_block(blockid_t b) {
+    auto f = block_fp.find(b);
+    if (f == block_fp.end()) return;
+    auto i = fp_index.find(f->second);
+    if (i != fp_index.end() && i->second == b) fp_index.erase(i);
+    block_fp.erase(f);
+}
+
+// Find an indexed block holding the same data, of CRC32C crc, and take a
+// reference to it. Return 0 if there is none. An indexed block is never
+// written in place, see unshare.
+blockid_t inode_manager::share_block(const char *data, uint32_t crc) {
+    char blk[BLOCK_SIZE_MAX];
+    blockid_t b = 0;
+    pthread_mutex_lock(&share_lock);
+    auto i = fp_index.find(crc);
+    if (i != fp_index.end() && bm->read_block(i->second, blk)) {
+        if (memcmp(blk, data, geo.block_size) == 0) {
+            b = i->second;
+            auto r = block_refs.find(b);
+            if (r == block_refs.end())
+                block_refs[b] = 2;
+            else
+                r->second++;
+        }
+    }
+    pthread_mutex_unlock(&share_lock);
+    return b;
+}
+
+// Take one more reference to every data block of ext.
+void inode_manager::share_blocks(const std::vector<extent_t> &ext) {
+    pthread_mutex_lock(&share_lock);
+    for (const extent_t &e : ext) {
+        for (uint32_t i = 0; e.start && i < e.len; i++) {
+            auto r = block_refs.find(e.start + i);
+            if (r == block_refs.end())
+                block_refs[e.start + i] = 2;
+            else
+                r->second++;
+        }
+    }
+    pthread_mutex_unlock(&share_lock);
+}
+
+// Drop a reference to each of the n blocks from start, freeing the ones
+// nothing else refers to.
+void inode_manager::release_blocks(blockid_t start, uint32_t n) {
+    pthread_mutex_lock(&share_lock);
+    if (block_refs.empty() && fp_index.empty()) {
+        pthread_mutex_unlock(&share_lock);
+        bm->free_blocks(start, n);
+        return;
+    }
+    blockid_t run = start;
+    uint32_t len = 0;
+    for (blockid_t b = start; b < start + n; b++) {
+        auto r = block_refs.find(b);
+        if (r != block_refs.end()) {
+            if (--r->second == 1) block_refs.erase(r);
+            if (len) bm->free_blocks(run, len);
+            len = 0;
+            continue;
+        }
+        unindex_block(b);
+        if (len == 0) run = b;
+        len++;
+    }
+    if (len) bm->free_blocks(run, len);
+    pthread_mutex_unlock(&share_lock);
+}
+
+// Whether some block of ext is shared or indexed, i.e. must not be written
+// in place.
+bool inode_manager::shares_blocks(const std::vector<extent_t> &ext) {
+    bool found = false;
+    pthread_mutex_lock(&share_lock);
+    if (!block_refs.empty() || !fp_index.empty()) {
+        for (const extent_t &e : ext)
+            for (uint32_t i = 0; e.start && i < e.len && !found; i++)
+                found = block_refs.count(e.start + i) ||
+                        block_fp.count(e.start + i);
+    }
+    pthread_mutex_unlock(&share_lock);
+    return found;
+}
+
+// Before logical blocks [first, first + n) of a file are written in place,
+// give it private copies of the shared ones among them, and drop the others
+// from the dedup index as their data is about to change. The copies are
+// appended to copies, the shared blocks to shared, to be released once the
+// new extents are stored. All or nothing.
+bool inode_manager::unshare(uint32_t inum, std::vector<extent_t> &ext,
+                            uint32_t first, uint32_t n,
+                            std::vector<extent_t> &copies,
+                            std::vector<extent_t> &shared) {
+    pthread_mutex_lock(&share_lock);
+    bool none = block_refs.empty() && fp_index.empty();
+    pthread_mutex_unlock(&share_lock);
+    if (none) return true;
+    std::vector<extent_t> out;
+    char blk[BLOCK_SIZE_MAX];
+    uint32_t pos = 0, end = first + n;
+    for (const extent_t &e : ext) {
+        if (e.start == 0 || pos + e.len <= first || pos >= end) {
+            append_extent(out, e);
+            pos += e.len;
+            continue;
+        }
+        for (uint32_t i = 0; i < e.len; i++) {
+            blockid_t b = e.start + i;
+            bool in_range = pos + i >= first && pos + i < end;
+            pthread_mutex_lock(&share_lock);
+            bool is_shared = in_range && block_refs.count(b);
+            if (in_range && !is_shared) unindex_block(b);
+            pthread_mutex_unlock(&share_lock);
+            if (!is_shared) {
+                append_extent(out, {b, 1});
+                continue;
+            }
+            const extent_t &last = out.empty() ? extent_t{0, 0} : out.back();
+            blockid_t copy;
+            if (!bm->alloc_blocks(1, &copy,
+                                  last.start ? last.start + last.len
+                                             : home_block(inum))) {
+                truncate_extents(copies, 0);
+                copies.clear();
+                shared.clear();
+                return false;
+            }
+            bm->read_block(b, blk);
+            bm->write_block(copy, blk);
+            append_extent(out, {copy, 1});
+            append_extent(copies, {copy, 1});
+            shared.push_back({b, 1});
+        }
+        pos += e.len;
+    }
+    ext.swap(out);
+    return true;
+}
+
+// Map nblk blocks of data, a whole file, to blocks: holes for zeros, an
+// indexed block with the same data if dedup is on, else a new block written
+// with it. Every block used is appended to fresh. All or nothing.
+bool inode_manager::dedup_fill(uint32_t inum, std::vector<extent_t> &ext,
+                               const char *data, uint32_t nblk,
+                               std::vector<extent_t> &fresh) {
+    for (uint32_t i = 0; i < nblk; i++) {
+        const char *p = data + (size_t)i * geo.block_size;
+        if (block_zero(p, geo.block_size)) {
+            append_extent(ext, {0, 1});
+            continue;
+        }
+        uint32_t crc = crc32c(0, p, geo.block_size);
+        blockid_t b = dedup ? share_block(p, crc) : 0;
+        if (b == 0) {
+            const extent_t &last = ext.empty() ? extent_t{0, 0} : ext.back();
+            if (!bm->alloc_blocks(1, &b,
+                                  last.start ? last.start + last.len
+                                             : home_block(inum))) {
+                truncate_extents(fresh, 0);
+                fresh.clear();
+                return false;
+            }
+            bm->write_block(b, p);
+            if (dedup) index_block(b, crc);
+        }
+        append_extent(ext, {b, 1});
+        fresh.push_back({b, 1});
+    }
+    return true;
+}
+
+// Share the data blocks of identical contents written by write_file. Turning
+// it on indexes the blocks already there; call it before serving requests.
+void inode_manager::set_dedup(bool on) {
+    if (on && !dedup) scan_blocks(true);
+    pthread_mutex_lock(&share_lock);
+    dedup = on;
+    if (!on) {
+        fp_index.clear();
+        block_fp.clear();
+    }
+    pthread_mutex_unlock(&share_lock);
+}
+
+// Delay the allocation of the blocks written to holes until the data is
+// flushed (see flush_file). Off by default, turning it off flushes.
+void inode_manager::set_delalloc(bool on) {
+    delalloc = on;
+    if (!on) flush_pending();
+}
+
+// Number of blocks of file inum waiting for blocks. Caller holds its lock.
+size_t inode_manager::pending_blocks(uint32_t inum) {
+    auto &files = pending[inum % INODE_LOCKS];
+    auto it = files.find(inum);
+    return it == files.end() ? 0 : it->second.size();
+}
+
+// Blocks reserved for a file with nblocks pending: their own, and room for
+// the extent blocks they may need, each one adding at most two extents.
+uint32_t inode_manager::delay_cost(size_t nblocks) const {
+    return nblocks + (2 * nblocks + geo.epb - 1) / geo.epb;
+}
+
+// Blocks to reserve on top of what file inum has for blocks [first, first
+// + n) to be pending too. Caller holds its lock.
+uint32_t inode_manager::more_pending(uint32_t inum, uint32_t first,
+                                     uint32_t n) {
+    auto &files = pending[inum % INODE_LOCKS];
+    auto it = files.find(inum);
+    size_t have = it == files.end() ? 0 : it->second.size();
+    size_t add = n;
+    if (it != files.end())
+        for (auto b = it->second.lower_bound(first);
+             b != it->second.end() && b->first < first + n; ++b)
+            add--;
+    return delay_cost(have + add) - delay_cost(have);
+}
+
+// Keep len bytes of buf, written at off to holes of file inum, in memory.
+// Caller holds its lock and reserved the blocks, see more_pending.
+void inode_manager::delay_blocks(uint32_t inum, uint32_t off, const char *buf,
+                                 uint32_t len) {
+    pending_t &blocks = pending[inum % INODE_LOCKS][inum];
+    uint32_t bs = geo.block_size;
+    uint64_t cur = off, end = (uint64_t)off + len;
+    while (cur < end) {
+        std::vector<char> &blk = blocks[cur >> geo.shift];
+        if (blk.empty()) {
+            blk.assign(bs, 0);
+            npending++;
+        }
+        uint32_t boff = cur & (bs - 1);
+        uint32_t n = MIN(bs - boff, end - cur);
+        memcpy(&blk[boff], buf + (cur - off), n);
+        cur += n;
+    }
+}
+
+// Forget the pending data of file inum, which is being rewritten or
+// removed, and give back its reservation unless the caller takes it over.
+// Caller holds its lock.
+void inode_manager::drop_pending(uint32_t inum, bool release) {
+    auto &files = pending[inum % INODE_LOCKS];
+    auto it = files.find(inum);
+    if (it == files.end()) return;
+    npending -= it->second.size();
+    if (release) bm->unreserve(delay_cost(it->second.size()));
+    files.erase(it);
+}
+
+// Copy the pending data of file inum in [off, off + len) over buf, which
+// holds these bytes as read from the disk. Caller holds its lock.
+void inode_manager::read_pending(uint32_t inum, uint32_t off, uint32_t len,
+                                 char *buf) {
+    auto &files = pending[inum % INODE_LOCKS];
+    auto it = files.find(inum);
+    if (it == files.end() || len == 0) return;
+    uint64_t end = (uint64_t)off + len;
+    uint32_t shift = geo.shift;
+    for (auto b = it->second.lower_bound(off >> shift);
+         b != it->second.end() && ((uint64_t)b->first << shift) < end; ++b) {
+        uint64_t lo = MAX((uint64_t)b->first << shift, off);
+        uint64_t hi = MIN((uint64_t)(b->first + 1) << shift, end);
+        memcpy(buf + (lo - off), &b->second[lo - ((uint64_t)b->first << shift)],
+               hi - lo);
+    }
+}
+
+// Give blocks to the pending data of file inum, whose inode is ino, and
+// write it there. The holes it fills are allocated together, a run as long
+// as each hole near the block before it or the inode, so a file written in
+// pieces or along with others still gets contiguous blocks and few
+// extents. The blocks come out of the reservation of the data, so there is
+// room for them. Caller holds the lock of inum within an operation.
+void inode_manager::flush_file(uint32_t inum, inode_t *ino) {
+    auto &files = pending[inum % INODE_LOCKS];
+    auto it = files.find(inum);
+    if (it == files.end()) return;
+    pending_t blocks = std::move(it->second);
+    files.erase(it);
+    npending -= blocks.size();
+    bm->draw_reserved(delay_cost(blocks.size()));
+    // blocks past the end of a file that shrank since are dropped
+    uint32_t nblk = geo.nblk(ino->size);
+    blocks.erase(blocks.lower_bound(nblk), blocks.end());
+    if (blocks.empty() || inode_inline(ino)) {
+        bm->end_draw();
+        return;
+    }
+    uint32_t first = blocks.begin()->first;
+    uint32_t n = blocks.rbegin()->first - first + 1;
+    // the blocks in between that are not pending are either allocated
+    // already, or holes which the zeros keep as holes
+    uint32_t bs = geo.block_size;
+    std::vector<char> data((size_t)n * bs, 0);
+    for (auto &b : blocks)
+        memcpy(&data[(size_t)(b.first - first) * bs], b.second.data(), bs);
+    std::vector<extent_t> ext, fresh, runs;
+    load_extents(inum, ino, ext);
+    bool ok = fill_holes(inum, ext, first, n, fresh, data.data());
+    if (ok && !store_extents(inum, ino, ext)) {
+        truncate_extents(fresh, 0);
+        ok = false;
+    }
+    bm->end_draw();
+    if (!ok) {
+        // the reservation should have made room, keep the data anyway
+        printf("ERR! no space left for inode %d, data kept in memory\n",
+               inum);
+        bm->reserve(delay_cost(blocks.size()), true);
+        npending += blocks.size();
+        files[inum] = std::move(blocks);
+        return;
+    }
+    resolve_extents(ext, first, n, runs);
+    const char *p = data.data();
+    for (const extent_t &r : runs) {
+        for (uint32_t i = 0; r.start && i < r.len;) {
+            uint32_t k = i;
+            while (k < r.len && in_extents(fresh, r.start + k)) k++;
+            if (k > i)
+                bm->write_blocks(r.start + i, k - i, p + (size_t)i * bs);
+            i = MAX(k, i + 1);
+        }
+        p += (size_t)r.len * bs;
+    }
+    put_inode(inum, ino);
+}
+
+// Flush the pending data of the files of stripe s. Caller holds its lock
+// within an operation.
+void inode_manager::flush_stripe(uint32_t s) {
+    std::vector<uint32_t> inums;
+    for (auto &f : pending[s]) inums.push_back(f.first);
+    for (uint32_t inum : inums) {
+        inode_t *ino = get_inode(inum);
+        if (ino)
+            flush_file(inum, ino);
+        else
+            drop_pending(inum);
+        free(ino);
+    }
+}
+
+// Flush the pending data of every file.
+void inode_manager::flush_pending() {
+    uint32_t seq = 0;
+    for (uint32_t s = 0; s < INODE_LOCKS; s++) {
+        op_begin(s);
+        flush_stripe(s);
+        seq = op_end(s);
+    }
+    bm->wait_op(seq);
+}
+
+// Inode table blocks a fsck thread takes at a time
+#define FSCK_CHUNK 8
+
+// Kinds of conflicting block: an extent block of two files, or an extent
+// block that is also the data of some file
+enum { FSCK_OK, FSCK_SHARED_META, FSCK_META };
+
+// The references to every block found by a scan of the inodes, as data or
+// as metadata (extent blocks and snapshot blocks).
+struct inode_manager::fsck_scan {
+    std::vector<uint32_t> data;
+    std::vector<uint32_t> meta;
+    std::vector<uint32_t> bad;      // keys of the inodes to repair
+    std::vector<uint32_t> unclean;  // free inodes that still hold extents
+    uint32_t inodes;
+};
+
+// Run fn(0), ..., fn(n - 1) on n threads.
+template <class F>
+static void run_threads(uint32_t n, F fn) {
+    std::vector<std::thread> ts;
+    for (uint32_t i = 1; i < n; i++) ts.emplace_back(fn, i);
+    fn(0);
+    for (std::thread &t : ts) t.join();
+}
+
+// Read the extents of ino from the disk, without the map cache, into ext
+// and its extent blocks into chain. The walk stops at an extent block that
+// is out of the data region or, given conflict, used by another file, and
+// ext ends before the first extent out of the data region. Return false if
+// anything was cut or does not add up.
+bool inode_manager::fsck_extents(const inode_t *ino,
+                                 const std::vector<uint8_t> *conflict,
+                                 std::vector<extent_t> &ext,
+                                 std::vector<blockid_t> &chain) {
+    ext.clear();
+    chain.clear();
+    if (inode_inline(ino)) return ino->size <= INLINE_SIZE;
+    ext.assign(ino->extents, ino->extents + MIN(ino->nextents, NEXTENT));
+    uint32_t nspill = ino->nextents > NEXTENT ? ino->nextents - NEXTENT : 0;
+    uint32_t max_chain = (nspill + geo.epb - 1) / geo.epb;
+    bool ok = true;
+    extent_block_t eb;
+    for (blockid_t id = ino->extent_blocks; id != 0; id = eb.next) {
+        if (id < bm->first_data() || id >= bm->sb.nblocks ||
+            chain.size() == max_chain ||
+            (conflict && (*conflict)[id] == FSCK_SHARED_META)) {
+            ok = false;
+            break;
+        }
+        chain.push_back(id);
+        buf_t *b = bc->bread(id);
+        bc->read(b, 0, &eb, geo.block_size);
+        bc->brelse(b);
+        if (eb.count > geo.epb) {
+            eb.count = geo.epb;
+            ok = false;
+        }
+        ext.insert(ext.end(), eb.extents, eb.extents + eb.count);
+    }
+    if (ext.size() != ino->nextents) ok = false;
+    for (size_t i = 0; i < ext.size(); i++) {
+        const extent_t &e = ext[i];
+        if (e.start != 0 && (e.start < bm->first_data() ||
+                             (uint64_t)e.start + e.len > bm->sb.nblocks)) {
+            ext.resize(i);
+            return false;
+        }
+    }
+    return ok;
+}
+
+static bool type_valid(short type) {
+    return type == extent_protocol::T_DIR || type == extent_protocol::T_FILE ||
+           type == extent_protocol::T_SYMLINK;
+}
+
+// Count the references of the inode of map cache key key, and add it to
+// the ones to repair if it is bad or, given conflict, refers to a
+// conflicting block.
+void inode_manager::fsck_inode(uint32_t key, const inode_t *ino,
+                               const std::vector<uint8_t> *conflict,
+                               fsck_scan &s) {
+    s.inodes++;
+    std::vector<extent_t> ext;
+    std::vector<blockid_t> chain;
+    bool ok = type_valid(ino->type) && fsck_extents(ino, conflict, ext, chain);
+    for (blockid_t b : chain) s.meta[b]++;
+    for (const extent_t &e : ext)
+        for (uint32_t i = 0; e.start && i < e.len; i++) {
+            s.data[e.start + i]++;
+            if (conflict && (*conflict)[e.start + i] != FSCK_OK) ok = false;
+        }
+    if (!ok) s.bad.push_back(key);
+}
+
+// Check the inodes of inode table block t, and their snapshot copies.
+void inode_manager::fsck_table_block(uint32_t t,
+                                     const std::vector<uint8_t> *conflict,
+                                     fsck_scan &s) {
+    inode_t slots[IPB_MAX];
+    buf_t *b = bc->bread(geo.iblock(t * geo.ipb));
+    bc->read(b, 0, slots, geo.ipb * sizeof(inode_t));
+    bc->brelse(b);
+    static const inode_t clean = {};
+    for (uint32_t i = 0; i < geo.ipb; i++) {
+        uint32_t inum = t * geo.ipb + i;
+        if (inum == 0) continue;
+        if (slots[i].type != 0)
+            fsck_inode(inum, &slots[i], conflict, s);
+        else if (slots[i].size || slots[i].nextents ||
+                 memcmp(slots[i].data, clean.data, INLINE_SIZE) != 0)
+            s.unclean.push_back(inum);
+    }
+    pthread_mutex_lock(&snap_lock);
+    blockid_t copy = t < snap_copies.size() ? snap_copies[t] : 0;
+    pthread_mutex_unlock(&snap_lock);
+    if (copy == 0) return;
+    b = bc->bread(copy);
+    bc->read(b, 0, slots, geo.ipb * sizeof(inode_t));
+    bc->brelse(b);
+    for (uint32_t i = 0; i < geo.ipb; i++)
+        if (slots[i].type != 0 && slots[i].type != SNAP_UNCHANGED)
+            fsck_inode(SNAP_INUM(t * geo.ipb + i), &slots[i], conflict, s);
+}
+
+// Scan every inode on nthreads threads, each taking FSCK_CHUNK inode table
+// blocks at a time and counting into a scan of its own, then add the
+// scans up, each thread taking a slice of the blocks.
+void inode_manager::fsck_inodes(uint32_t nthreads,
+                                const std::vector<uint8_t> *conflict,
+                                fsck_scan &s) {
+    uint32_t nblocks = bm->sb.nblocks;
+    uint32_t ntable = bm->sb.ninodes / geo.ipb;
+    std::vector<fsck_scan> part(nthreads);
+    std::atomic<uint32_t> next(0);
+    run_threads(nthreads, [&](uint32_t i) {
+        fsck_scan &p = part[i];
+        p.data.assign(nblocks, 0);
+        p.meta.assign(nblocks, 0);
+        p.inodes = 0;
+        for (uint32_t c; (c = next++) * FSCK_CHUNK < ntable;)
+            for (uint32_t t = c * FSCK_CHUNK;
+                 t < MIN((c + 1) * FSCK_CHUNK, ntable); t++)
+                fsck_table_block(t, conflict, p);
+    });
+    s.data.assign(nblocks, 0);
+    s.meta.assign(nblocks, 0);
+    run_threads(nthreads, [&](uint32_t i) {
+        uint32_t from = (uint64_t)nblocks * i / nthreads;
+        uint32_t to = (uint64_t)nblocks * (i + 1) / nthreads;
+        for (const fsck_scan &p : part)
+            for (uint32_t b = from; b < to; b++) {
+                s.data[b] += p.data[b];
+                s.meta[b] += p.meta[b];
+            }
+    });
+    s.bad.clear();
+    s.unclean.clear();
+    s.inodes = 0;
+    for (const fsck_scan &p : part) {
+        s.bad.insert(s.bad.end(), p.bad.begin(), p.bad.end());
+        s.unclean.insert(s.unclean.end(), p.unclean.begin(), p.unclean.end());
+        s.inodes += p.inodes;
+    }
+    std::sort(s.bad.begin(), s.bad.end());
+    std::sort(s.unclean.begin(), s.unclean.end());
+    // the snapshot table, its index and copy blocks
+    pthread_mutex_lock(&snap_lock);
+    for (blockid_t t : snap_table) s.meta[t]++;
+    for (blockid_t t : snap_index) s.meta[t]++;
+    for (blockid_t c : snap_copies)
+        if (c) s.meta[c]++;
+    pthread_mutex_unlock(&snap_lock);
+}
+
+// Compare the references of scan s with the bitmap and the reference
+// counts of the shared blocks, on nthreads threads. Set conflict for
+// every block of the data region.
+void inode_manager::fsck_blocks(uint32_t nthreads, const fsck_scan &s,
+                                std::vector<uint8_t> &conflict,
+                                std::vector<blockid_t> &leaked,
+                                std::vector<blockid_t> &unmarked,
+                                uint32_t &bad_refs) {
+    std::vector<uint64_t> bits;
+    bm->get_bitmap(bits);
+    uint32_t first = bm->first_data(), nblocks = bm->sb.nblocks;
+    conflict.assign(nblocks, FSCK_OK);
+    std::vector<std::vector<blockid_t>> part_leaked(nthreads),
+        part_unmarked(nthreads);
+    std::vector<uint32_t> part_refs(nthreads, 0);
+    pthread_mutex_lock(&share_lock);
+    run_threads(nthreads, [&](uint32_t i) {
+        uint32_t from = first + (uint64_t)(nblocks - first) * i / nthreads;
+        uint32_t to = first + (uint64_t)(nblocks - first) * (i + 1) / nthreads;
+        for (uint32_t b = from; b < to; b++) {
+            uint32_t data = s.data[b], meta = s.meta[b];
+            bool used = bit_used(bits, b);
+            if (used && data + meta == 0) part_leaked[i].push_back(b);
+            if (!used && data + meta > 0) part_unmarked[i].push_back(b);
+            if (meta > 1)
+                conflict[b] = FSCK_SHARED_META;
+            else if (meta == 1 && data > 0)
+                conflict[b] = FSCK_META;
+            if (meta) continue;
+            auto it = block_refs.find(b);
+            uint32_t refs = it == block_refs.end() ? 0 : it->second;
+            if (refs != (data > 1 ? data : 0)) part_refs[i]++;
+        }
+    });
+    pthread_mutex_unlock(&share_lock);
+    leaked.clear();
+    unmarked.clear();
+    bad_refs = 0;
+    for (uint32_t i = 0; i < nthreads; i++) {
+        leaked.insert(leaked.end(), part_leaked[i].begin(),
+                      part_leaked[i].end());
+        unmarked.insert(unmarked.end(), part_unmarked[i].begin(),
+                        part_unmarked[i].end());
+        bad_refs += part_refs[i];
+    }
+}
+
+// Repair the inode of map cache key key: clear it if its type is bad, else
+// keep its extents up to the first one out of the data region, turn the
+// blocks it shares with an extent block into holes, and give it new extent
+// blocks.
+void inode_manager::fsck_fix(uint32_t key, const std::vector<uint8_t> &conflict) {
+    uint32_t inum = key & 0x7fffffff;
+    bool copy = key != inum;
+    blockid_t slot_block =
+        copy ? snap_copies[inum / geo.ipb] : geo.iblock(inum);
+    size_t off = inum % geo.ipb * sizeof(inode_t);
+    inode_t ino;
+    buf_t *b = bc->bread(slot_block);
+    bc->read(b, off, &ino, sizeof(ino));
+    bc->brelse(b);
+    pthread_mutex_lock(&map_lock);
+    uncache_map(key);
+    pthread_mutex_unlock(&map_lock);
+    if (!type_valid(ino.type)) {
+        // a copy that is cleared shows the file as absent from the snapshot
+        bzero(&ino, sizeof(ino));
+        if (!copy) {
+            drop_pending(inum);
+            give_inode(inum);
+        }
+    } else if (inode_inline(&ino)) {
+        ino.size = MIN(ino.size, INLINE_SIZE);
+    } else {
+        std::vector<extent_t> found, ext;
+        std::vector<blockid_t> chain;
+        fsck_extents(&ino, &conflict, found, chain);
+        for (const extent_t &e : found) {
+            if (e.start == 0) {
+                append_extent(ext, e);
+                continue;
+            }
+            for (uint32_t i = 0; i < e.len; i++) {
+                blockid_t blk = e.start + i;
+                append_extent(ext, {conflict[blk] == FSCK_OK ? blk : 0, 1});
+            }
+        }
+        // the old extent blocks are leaked, and freed as such
+        ino.nextents = 0;
+        ino.extent_blocks = 0;
+        if (!store_extents(key, &ino, ext)) {
+            ext.resize(MIN(ext.size(), NEXTENT));
+            store_extents(key, &ino, ext);
+        }
+        uint64_t nblk = 0;
+        for (const extent_t &e : ext) nblk += e.len;
+        ino.size = MIN(ino.size, nblk * geo.block_size);
+    }
+    b = bc->bread(slot_block);
+    bc->write(b, off, &ino, sizeof(ino));
+    bc->brelse(b);
+}
+
+// Scan the inodes and compare them with the bitmap, see fsck_inodes and
+// fsck_blocks, and count what is wrong in r. Return the number of
+// problems.
+int inode_manager::fsck_check(uint32_t nthreads, fsck_scan &s,
+                              std::vector<uint8_t> &conflict,
+                              std::vector<blockid_t> &leaked,
+                              std::vector<blockid_t> &unmarked,
+                              fsck_report_t &r) {
+    fsck_inodes(nthreads, NULL, s);
+    fsck_blocks(nthreads, s, conflict, leaked, unmarked, r.bad_refs);
+    r.inodes = s.inodes;
+    r.bad_inodes = s.bad.size();
+    r.unclean = s.unclean.size();
+    r.leaked = leaked.size();
+    r.unmarked = unmarked.size();
+    r.conflicts = 0;
+    for (uint8_t c : conflict)
+        if (c != FSCK_OK) r.conflicts++;
+    return r.bad_inodes + r.unclean + r.leaked + r.unmarked + r.conflicts +
+           r.bad_refs;
+}
+
+// Check that the bitmap, the inode table and the extents of the files
+// agree: every block a file, a snapshot copy or the snapshot refers to
+// must be marked used, once unless it is a shared data block with the
+// right reference count, and every used block must be referred to. The
+// inodes are scanned on nthreads threads, all cores if 0. A check first
+// runs alongside the file operations and is trusted if it finds nothing;
+// what it finds may be operations half done, so it is checked again with
+// file operations waiting, as is all of a repair. With repair, what is
+// wrong is fixed: bad inodes are cut back to their valid extents (see
+// fsck_fix), then leaked blocks freed and the reference counts rebuilt.
+// Return the number of problems found, and the details in r.
+int inode_manager::fsck(bool repair, uint32_t nthreads, fsck_report_t &r) {
+    if (nthreads == 0) nthreads = MAX(std::thread::hardware_concurrency(), 1);
+    fsck_scan s;
+    std::vector<uint8_t> conflict;
+    std::vector<blockid_t> leaked, unmarked;
+    bool quiet = !repair && fsck_check(nthreads, s, conflict, leaked,
+                                       unmarked, r) == 0;
+    if (!quiet) {
+        op_begin_all();
+        fsck_check(nthreads, s, conflict, leaked, unmarked, r);
+    }
+    for (uint32_t key : s.bad)
+        printf("\tfsck: %s %u is bad\n",
+               key & 0x80000000 ? "snapshot copy of inode" : "inode",
+               key & 0x7fffffff);
+    printf("\tfsck: %u inodes, %u bad, %u free but unclean; %u blocks "
+           "leaked, %u in use but free, %u doubly allocated, %u with a "
+           "wrong reference count\n",
+           r.inodes, r.bad_inodes, r.unclean, r.leaked, r.unmarked,
+           r.conflicts, r.bad_refs);
+    int problems = r.bad_inodes + r.unclean + r.leaked + r.unmarked +
+                   r.conflicts + r.bad_refs;
+    if (quiet) return 0;
+    if (repair && problems) {
+        // nothing may be allocated over a block in use before it is fixed
+        for (blockid_t b : unmarked) bm->use_block(b);
+        if (r.conflicts) fsck_inodes(nthreads, &conflict, s);
+        for (uint32_t key : s.bad) fsck_fix(key, conflict);
+        static const inode_t clean = {};
+        for (uint32_t inum : s.unclean) {
+            inode_t ino = clean;
+            put_inode(inum, &ino);
+        }
+        // what the repairs left over is leaked
+        uint32_t bad_refs;
+        fsck_inodes(nthreads, NULL, s);
+        fsck_blocks(nthreads, s, conflict, leaked, unmarked, bad_refs);
+        for (blockid_t b : unmarked) bm->use_block(b);
+        pthread_mutex_lock(&share_lock);
+        for (blockid_t b : leaked) {
+            bc->forget(b);
+            unindex_block(b);
+            bm->free_block(b);
+        }
+        block_refs.clear();
+        for (uint32_t b = bm->first_data(); b < bm->sb.nblocks; b++)
+            if (s.meta[b] == 0 && s.data[b] > 1) block_refs[b] = s.data[b];
+        pthread_mutex_unlock(&share_lock);
+        printf("\tfsck: repaired, %u blocks freed\n",
+               (uint32_t)leaked.size());
+    }
+    bm->wait_op(op_end_all());
+    return problems;
+}
+
+// Choose which block reads are checked, see VERIFY_NONE and friends.
+void inode_manager::set_verify(int mode) {
+    bm->set_verify(mode);
+}
+
+// Keep the extent maps of up to nfiles files in memory, 0 disables it.
+void inode_manager::set_map_cache(size_t nfiles) {
+    pthread_mutex_lock(&map_lock);
+    map_cache_size = nfiles;
+    map_cache.clear();
+    map_lru.clear();
+    pthread_mutex_unlock(&map_lock);
+}
+
+void inode_manager::cache_stats(uint64_t &hits, uint64_t &misses,
+                                uint64_t &writebacks) {
+    bc->stats(hits, misses, writebacks);
+}
+
+// Move the contents of an inline file to a data block of its own, which
+// becomes the only extent in ext. The inode is left with no extent for
+// store_extents to fill in.
+bool inode_manager::promote_inline(uint32_t inum, inode_t *ino,
+                                   std::vector<extent_t> &ext) {
+    char blk[BLOCK_SIZE_MAX];
+    std::vector<extent_t> fresh;
+    ext.assign(1, {0, 1});
+    if (!fill_holes(inum, ext, 0, 1, fresh)) return false;
+    bzero(blk, sizeof(blk));
+    memcpy(blk, ino->data, ino->size);
+    bm->write_block(ext[0].start, blk);
+    ino->nextents = 0;
+    bzero(ino->data, sizeof(ino->data));
+    return true;
+}
+
+// Allocate blocks for the holes in logical blocks [first, first + n) of a
+// file inum, asking for them right after the block before so that extents
+// can simply be extended, or in the group of the file. If data, the
+// contents of those blocks, is given, the blocks of zeros are left as
+// holes. The runs allocated are appended to fresh. All or nothing.
+bool inode_manager::fill_holes(uint32_t inum, std::vector<extent_t> &ext,
+                               uint32_t first, uint32_t n,
+                               std::vector<extent_t> &fresh,
+                               const char *data) {
+    std::vector<extent_t> out;
+    size_t nfresh = fresh.size();
+    uint32_t pos = 0, end = first + n;
+    auto zero = [&](uint32_t b) {
+        return data && block_zero(data + (size_t)(b - first) * geo.block_size,
+                                  geo.block_size);
+    };
+    for (const extent_t &e : ext) {
+        uint32_t lo = MAX(pos, first), hi = MIN(pos + e.len, end);
+        if (e.start != 0 || lo >= hi) {
+            append_extent(out, e);
+            pos += e.len;
+            continue;
+        }
+        if (lo > pos) append_extent(out, {0, lo - pos});
+        for (uint32_t b = lo; b < hi;) {
+            bool z = zero(b);
+            uint32_t next = b + 1;
+            while (next < hi && zero(next) == z) next++;
+            if (z) {
+                append_extent(out, {0, next - b});
+            } else {
+                std::vector<blockid_t> ids(next - b);
+                const extent_t &last = out.empty() ? extent_t{0, 0} : out.back();
+                blockid_t goal =
+                    last.start ? last.start + last.len : home_block(inum);
+                if (!bm->alloc_blocks(ids.size(), ids.data(), goal)) {
+                    std::vector<extent_t> undo(fresh.begin() + nfresh,
+                                               fresh.end());
+                    truncate_extents(undo, 0);
+                    fresh.resize(nfresh);
+                    return false;
+                }
+                for (blockid_t id : ids) {
+                    append_extent(out, {id, 1});
+                    append_extent(fresh, {id, 1});
+                }
+            }
+            b = next;
+        }
+        if (pos + e.len > hi) append_extent(out, {0, pos + e.len - hi});
+        pos += e.len;
+    }
+    ext.swap(out);
+    return true;
+}
+
+// Keep the first nblk blocks of the file, release the others.
+void inode_manager::truncate_extents(std::vector<extent_t> &ext,
+                                     uint32_t nblk) {
+    uint32_t pos = 0;
+    size_t keep = 0;
+    for (extent_t &e : ext) {
+        if (pos + e.len <= nblk) {
+            pos += e.len;
+            keep++;
+            continue;
+        }
+        uint32_t cut = pos < nblk ? nblk - pos : 0;
+        if (e.start) release_blocks(e.start + cut, e.len - cut);
+        e.len = cut;
+        pos += cut;
+        if (cut) keep++;
     }
+    ext.resize(keep);
 }
@@ -59,7 +59,7 @@ lock_protocol::status lock_client_cache::acquire(lock_protocol::lockid_t lid) {
     // last_locked = "acq";
     // tprintf("%s acquire %llu\n", TID, lid);
     int ret = lock_protocol::OK;
-    bool done = false;
+    bool done = false, granted = false;
     while (!done) {
         // tprintf("%s [lock %llu] [state %d]\n", TID, lid, lock_state[lid]);
         switch (lock_state[lid]) {
@@ -79,7 +79,7 @@ lock_protocol::status lock_client_cache::acquire(lock_protocol::lockid_t lid) {
                     case lock_protocol::OK:
                         lock_state[lid] = LOCKED;
                         ret = lock_protocol::OK;
-                        done = true;
+                        done = granted = true;
                         break;
                     case lock_protocol::RETRY:
                         // tprintf("%s waiting for retry...\n", TID);
@@ -118,6 +118,8 @@ lock_protocol::status lock_client_cache::acquire(lock_protocol::lockid_t lid) {
         }
     }
     pthread_mutex_unlock(&mutex);
+    // what was cached of lid without the lock may be stale by now
+    if (granted && yfs_master) yfs_master->onLockGrant(lid);
     return ret;
 }
 
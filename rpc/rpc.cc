@@ -411,7 +411,7 @@ compress:
 }
 
 
-rpcs::rpcs(unsigned int p1, int count)
+rpcs::rpcs(unsigned int p1, int count, int nthreads)
   : port_(p1), counting_(count), curr_counts_(count), lossytest_(0), reachable_ (true)
 {
 	VERIFY(pthread_mutex_init(&procs_m_, 0) == 0);
@@ -429,7 +429,7 @@ rpcs::rpcs(unsigned int p1, int count)
 	}
 
 	reg(rpc_const::bind, this, &rpcs::rpcbind);
-	dispatchpool_ = new ThrPool(10,false);
+	dispatchpool_ = new ThrPool(nthreads,false);
 
 	listener_ = new tcpsconn(this, port_, lossytest_);
 }
@@ -346,7 +346,7 @@ class rpcs : public chanmgr {
 	tcpsconn* listener_;
 
 	public:
-	rpcs(unsigned int port, int counts=0);
+	rpcs(unsigned int port, int counts=0, int nthreads=10);
 	~rpcs();
 
 	//RPC handler for clients binding
@@ -0,0 +1,268 @@
+// Tests of the extent server, run in-process against an in-memory disk,
+// with requests on the calling thread and on shard workers.
+//
+// Usage: test-lab4-extent
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "extent_server.h"
+
+#define CHECK(cond, ...)                                             \
+    do {                                                             \
+        if (!(cond)) {                                               \
+            printf("test-lab4-extent: %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__);                                     \
+            printf("\n");                                            \
+            exit(1);                                                 \
+        }                                                            \
+    } while (0)
+
+static extent_protocol::extentid_t new_file(extent_server &es) {
+    extent_protocol::extentid_t id = 0;
+    CHECK(es.create(extent_protocol::T_FILE, 1, id) == extent_protocol::OK &&
+              id != 0,
+          "create failed");
+    return id;
+}
+
+static std::string contents(extent_server &es, extent_protocol::extentid_t id) {
+    std::string buf;
+    CHECK(es.get(id, buf) == extent_protocol::OK, "get of %llu failed", id);
+    return buf;
+}
+
+static extent_protocol::op make_op(uint32_t code, extent_protocol::extentid_t id,
+                                   const std::string &data = "") {
+    extent_protocol::op o;
+    o.code = code;
+    o.id = id;
+    o.data = data;
+    return o;
+}
+
+// compound requests ----------------------------------------------------
+
+// A compound request runs its ops in order up to the first that fails,
+// which ends it: the ops before it are done, the ones after it are not,
+// and there is a result for each op run.
+static void test_compound(extent_server &es) {
+    extent_protocol::extentid_t a = new_file(es), b = new_file(es),
+                                gone = new_file(es);
+    int unused;
+    CHECK(es.remove(gone, unused) == extent_protocol::OK, "remove failed");
+
+    std::vector<extent_protocol::op> ops = {
+        make_op(extent_protocol::put, a, "one"),
+        make_op(extent_protocol::getattr, a),
+        make_op(extent_protocol::put, gone, "two"),  // no such file
+        make_op(extent_protocol::put, b, "three"),
+        make_op(extent_protocol::remove, a),
+    };
+    std::vector<extent_protocol::result> results;
+    CHECK(es.compound(ops, results) == extent_protocol::OK,
+          "compound failed as a whole");
+    CHECK(results.size() == 3, "%zu results, expected 3", results.size());
+    CHECK(results[0].st == extent_protocol::OK &&
+              results[1].st == extent_protocol::OK,
+          "the ops before the failure failed");
+    CHECK(results[1].a.size == 3, "getattr saw %u bytes, not the put",
+          results[1].a.size);
+    CHECK(results[2].st != extent_protocol::OK, "put of a removed file");
+    CHECK(contents(es, a) == "one", "the op before the failure is lost");
+    CHECK(contents(es, b).empty(), "an op after the failure ran");
+
+    // an op the server does not know fails like any other
+    ops = {make_op(extent_protocol::fsck, a),
+           make_op(extent_protocol::put, b, "four")};
+    results.clear();
+    es.compound(ops, results);
+    CHECK(results.size() == 1 && results[0].st == extent_protocol::IOERR,
+          "an unknown op should fail alone");
+    CHECK(contents(es, b).empty(), "an op after an unknown one ran");
+
+    // and without a failure every op has its result
+    ops = {make_op(extent_protocol::put, b, "five"),
+           make_op(extent_protocol::get, b)};
+    results.clear();
+    es.compound(ops, results);
+    CHECK(results.size() == 2 && results[1].st == extent_protocol::OK &&
+              results[1].data == "five",
+          "a compound request without a failure");
+}
+
+// directory index ------------------------------------------------------
+
+#define DIR_THREADS 4
+#define DIR_NAMES 32
+#define DIR_ROUNDS 20
+
+struct dir_arg {
+    extent_server *es;
+    extent_protocol::extentid_t dir;
+    int t;
+    const std::vector<extent_protocol::extentid_t> *files;
+    std::atomic<bool> *done;
+};
+
+static std::string churn_name(int t, int i) {
+    return "churn" + std::to_string(t) + "." + std::to_string(i);
+}
+
+// Add names of its own to the directory and remove them again, round
+// after round, ending with none left.
+static void *dir_churner(void *p) {
+    dir_arg *a = (dir_arg *)p;
+    for (int r = 0; r < DIR_ROUNDS; r++) {
+        int unused;
+        for (int i = 0; i < DIR_NAMES; i++)
+            CHECK(a->es->dir_add(a->dir, churn_name(a->t, i),
+                                 (*a->files)[i], unused) == extent_protocol::OK,
+                  "thread %d: dir_add of %s failed", a->t,
+                  churn_name(a->t, i).c_str());
+        // every other name first, so that the entries left are spread out
+        for (int k = 0; k < 2; k++)
+            for (int i = k; i < DIR_NAMES; i += 2) {
+                extent_protocol::extentid_t id = 0;
+                CHECK(a->es->dir_remove(a->dir, churn_name(a->t, i), id) ==
+                              extent_protocol::OK &&
+                          id == (*a->files)[i],
+                      "thread %d: dir_remove of %s failed", a->t,
+                      churn_name(a->t, i).c_str());
+            }
+    }
+    return NULL;
+}
+
+// Look names up while the churners run: the fixed ones must always be
+// found, the churned ones either found with the right file or not at all.
+// Writes to other files drop their indexes on the way.
+static void *dir_looker(void *p) {
+    dir_arg *a = (dir_arg *)p;
+    const std::vector<extent_protocol::extentid_t> &files = *a->files;
+    int n = 0;
+    while (!*a->done || n == 0) {
+        n++;
+        extent_protocol::extentid_t id = 0;
+        CHECK(a->es->dir_lookup(a->dir, "fixed", id) == extent_protocol::OK &&
+                  id == files[0],
+              "fixed entry lost");
+        int t = n % DIR_THREADS, i = n % DIR_NAMES;
+        int r = a->es->dir_lookup(a->dir, churn_name(t, i), id);
+        CHECK(r == extent_protocol::NOENT ||
+                  (r == extent_protocol::OK && id == files[i]),
+              "lookup of %s: status %d, file %llu", churn_name(t, i).c_str(),
+              r, id);
+        std::vector<extent_protocol::dirent> ents;
+        CHECK(a->es->readdirplus(a->dir, ents) == extent_protocol::OK,
+              "readdirplus failed");
+        bool fixed = false;
+        for (const extent_protocol::dirent &e : ents) {
+            if (e.name == "fixed") fixed = true;
+            CHECK(e.id != 0, "readdirplus listed a tombstone");
+        }
+        CHECK(fixed, "readdirplus lost the fixed entry");
+        int written;
+        a->es->write(files[i], 0, "x", written);
+    }
+    return NULL;
+}
+
+static void test_dir_race(extent_server &es) {
+    std::vector<extent_protocol::extentid_t> files;
+    for (int i = 0; i < DIR_NAMES; i++) files.push_back(new_file(es));
+    extent_protocol::extentid_t dir = 0;
+    CHECK(es.create(extent_protocol::T_DIR, 1, dir) == extent_protocol::OK &&
+              dir != 0,
+          "create of a directory failed");
+    int unused;
+    CHECK(es.dir_add(dir, "fixed", files[0], unused) == extent_protocol::OK,
+          "dir_add failed");
+
+    std::atomic<bool> done(false);
+    pthread_t churners[DIR_THREADS], looker;
+    dir_arg args[DIR_THREADS + 1];
+    for (int t = 0; t <= DIR_THREADS; t++)
+        args[t] = {&es, dir, t, &files, &done};
+    for (int t = 0; t < DIR_THREADS; t++)
+        CHECK(pthread_create(&churners[t], NULL, dir_churner, &args[t]) == 0,
+              "pthread_create failed");
+    CHECK(pthread_create(&looker, NULL, dir_looker, &args[DIR_THREADS]) == 0,
+          "pthread_create failed");
+    for (int t = 0; t < DIR_THREADS; t++) pthread_join(churners[t], NULL);
+    done = true;
+    pthread_join(looker, NULL);
+
+    // only the fixed entry is left, in the index and as stored, which
+    // was compacted along the way
+    std::string data = contents(es, dir);
+    int n = 0;
+    dir_for_each(data, [&](const std::string &name,
+                           extent_protocol::extentid_t id, size_t, size_t) {
+        CHECK(name == "fixed" && id == files[0], "entry %s left",
+              name.c_str());
+        n++;
+        return true;
+    });
+    CHECK(n == 1, "%d entries left", n);
+    CHECK(data.size() <= 2 * dir_entry("fixed", files[0]).size(),
+          "%zu bytes left, the directory was not compacted", data.size());
+    extent_protocol::extentid_t id;
+    CHECK(es.dir_lookup(dir, churn_name(0, 0), id) == extent_protocol::NOENT,
+          "a removed entry is still indexed");
+}
+
+int main(int argc, char *argv[]) {
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    printf("compound requests stop at the first failure: ");
+    {
+        extent_server es;
+        test_compound(es);
+    }
+    printf("OK\n");
+
+    printf("compound requests on shard workers: ");
+    {
+        extent_server es(NULL, false, geometry_t(), 2);
+        test_compound(es);
+    }
+    printf("OK\n");
+
+    // the commits of a journal, waited for by this thread, not the workers
+    printf("compound requests on shard workers, journaled: ");
+    {
+        std::string image = "/tmp/test-lab4-extent." +
+                            std::to_string(getpid()) + ".img";
+        extent_server es(image.c_str(), false, geometry_t(), 2);
+        test_compound(es);
+        test_dir_race(es);
+        for (const char *ext : {"", ".crc", ".journal"})
+            unlink((image + ext).c_str());
+    }
+    printf("OK\n");
+
+    printf("directory changes racing with lookups: ");
+    {
+        extent_server es;
+        test_dir_race(es);
+    }
+    printf("OK\n");
+
+    printf("directory changes racing with lookups, on shard workers: ");
+    {
+        extent_server es(NULL, false, geometry_t(), 2);
+        test_dir_race(es);
+    }
+    printf("OK\n");
+
+    printf("test-lab4-extent: passed all tests\n");
+    return 0;
+}
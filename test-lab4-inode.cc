@@ -0,0 +1,836 @@
+// Tests of the inode layer, run in-process against an in-memory disk and
+// against an image file.
+//
+// Usage: test-lab4-inode [dir]
+// dir holds the image files, /tmp by default.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "inode_manager.h"
+
+static std::string dir = "/tmp";
+
+#define CHECK(cond, ...)                                        \
+    do {                                                        \
+        if (!(cond)) {                                          \
+            printf("test-lab4-inode: %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__);                                \
+            printf("\n");                                       \
+            exit(1);                                            \
+        }                                                       \
+    } while (0)
+
+static std::string image_path(const char *name) {
+    std::string path = dir + "/test-lab4-inode-" + name + ".img";
+    unlink(path.c_str());
+    unlink((path + ".crc").c_str());
+    unlink((path + ".journal").c_str());
+    return path;
+}
+
+static void remove_image(const std::string &path) {
+    unlink(path.c_str());
+    unlink((path + ".crc").c_str());
+    unlink((path + ".journal").c_str());
+}
+
+// Whether another process can mount image path and finds it clean.
+static bool mounts_elsewhere(const std::string &path) {
+    pid_t pid = fork();
+    CHECK(pid >= 0, "fork failed");
+    if (pid == 0) {
+        if (image_in_use(path.c_str())) _exit(1);
+        inode_manager im(path.c_str());
+        fsck_report_t r;
+        _exit(im.fsck(false, 1, r) == 0 ? 0 : 2);
+    }
+    int status;
+    return waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+           WEXITSTATUS(status) == 0;
+}
+
+// Contents of round r of file i of thread t, a few blocks long and
+// different for every file, round and thread.
+static std::string contents(int t, int i, int r) {
+    char tag[64];
+    snprintf(tag, sizeof(tag), "<%d.%d.%d>", t, i, r);
+    std::string s;
+    size_t len = BLOCK_SIZE * (1 + (t + i + r) % 3) + t * 7 + i;
+    while (s.size() < len) s += tag;
+    s.resize(len);
+    return s;
+}
+
+// striped inode locks ------------------------------------------------
+
+#define STRIPE_THREADS 8
+#define STRIPE_FILES 16
+#define STRIPE_ROUNDS 20
+
+struct stripe_arg {
+    inode_manager *im;
+    int t;
+};
+
+// Create, write, rewrite, read back and remove files, each thread on its
+// own files, all threads at once: the files of different threads share
+// stripes, inode table blocks and allocation groups.
+static void *stripe_worker(void *p) {
+    stripe_arg *a = (stripe_arg *)p;
+    inode_manager *im = a->im;
+    for (int r = 0; r < STRIPE_ROUNDS; r++) {
+        std::vector<uint32_t> inums;
+        for (int i = 0; i < STRIPE_FILES; i++) {
+            uint32_t inum = im->alloc_inode(extent_protocol::T_FILE);
+            CHECK(inum != 0, "thread %d: alloc_inode failed", a->t);
+            std::string s = contents(a->t, i, r);
+            im->write_file(inum, s.data(), s.size());
+            inums.push_back(inum);
+        }
+        for (int i = 0; i < STRIPE_FILES; i++) {
+            // a partial rewrite in the middle of the file
+            std::string s = contents(a->t, i, r);
+            const char patch[] = "patched";
+            uint32_t off = s.size() / 2;
+            CHECK(im->write_range(inums[i], off, patch, sizeof(patch)) ==
+                      (int)sizeof(patch),
+                  "thread %d: write_range of %u failed", a->t, inums[i]);
+            memcpy(&s[off], patch, sizeof(patch));
+
+            char *buf = NULL;
+            int size = 0;
+            im->read_file(inums[i], &buf, &size);
+            CHECK(std::string(buf, size) == s,
+                  "thread %d: file %u has wrong contents", a->t, inums[i]);
+            free(buf);
+            extent_protocol::attr at;
+            im->getattr(inums[i], at);
+            CHECK(at.type == extent_protocol::T_FILE && at.size == s.size(),
+                  "thread %d: file %u has wrong attributes", a->t, inums[i]);
+        }
+        for (uint32_t inum : inums) im->remove_file(inum);
+    }
+    return NULL;
+}
+
+static void test_stripes(inode_manager *im) {
+    uint32_t before = im->alloc_inode(extent_protocol::T_FILE);
+    im->remove_file(before);
+
+    pthread_t th[STRIPE_THREADS];
+    stripe_arg args[STRIPE_THREADS];
+    for (int t = 0; t < STRIPE_THREADS; t++) {
+        args[t] = {im, t};
+        CHECK(pthread_create(&th[t], NULL, stripe_worker, &args[t]) == 0,
+              "pthread_create failed");
+    }
+    for (int t = 0; t < STRIPE_THREADS; t++) pthread_join(th[t], NULL);
+
+    // every inode and block went back
+    fsck_report_t r;
+    CHECK(im->fsck(false, 1, r) == 0,
+          "fsck after the threads: %u leaked, %u unmarked, %u bad inodes",
+          r.leaked, r.unmarked, r.bad_inodes);
+    uint32_t after = im->alloc_inode(extent_protocol::T_FILE);
+    CHECK(after == before, "inode %u handed out, expected %u again", after,
+          before);
+    im->remove_file(after);
+}
+
+// inode index ---------------------------------------------------------
+
+// With 65536 inodes a group has 8192, more than one word of inode_full
+// covers: fill a group past the first 4096 and hand one back.
+static void test_large_inode_groups() {
+    geometry_t geo(4096, 16384, 65536);
+    CHECK(geo.valid() && geo.ag_inodes == 8192,
+          "geometry should have groups of 8192 inodes");
+    inode_manager im(NULL, geo);
+    std::vector<uint32_t> inums;
+    for (uint32_t i = 0; i < 6000; i++) {
+        uint32_t inum = im.alloc_inode(extent_protocol::T_FILE, 1);
+        CHECK(inum == i + 2, "inode %u handed out, expected %u", inum, i + 2);
+        inums.push_back(inum);
+    }
+    im.remove_file(4500);
+    uint32_t again = im.alloc_inode(extent_protocol::T_FILE, 1);
+    CHECK(again == 4500, "inode %u handed out, expected 4500 again", again);
+    CHECK(im.alloc_inode(extent_protocol::T_FILE, 1) == 6002,
+          "the group should go on after the inodes in use");
+}
+
+// ranged reads and writes ----------------------------------------------
+
+// Read len bytes at off of inum with read_range.
+static std::string read_at(inode_manager &im, uint32_t inum, uint32_t off,
+                           uint32_t len) {
+    std::string buf(len, '?');
+    int n = im.read_range(inum, off, len, &buf[0]);
+    CHECK(n >= 0, "read_range of %u at %u failed", inum, off);
+    buf.resize(n);
+    return buf;
+}
+
+// Write and read ranges that start and end on block boundaries, straddle
+// them, start at or past the end of the file, or would take it past 4 GiB,
+// against a model of the file.
+static void test_ranges() {
+    inode_manager im;
+    uint32_t inum = im.alloc_inode(extent_protocol::T_FILE);
+    CHECK(inum != 0, "alloc_inode failed");
+    std::string model;
+    struct {
+        uint32_t off, len;
+    } writes[] = {
+        {0, 10},                      // inline
+        {BLOCK_SIZE - 1, 2},          // across the first boundary
+        {BLOCK_SIZE, BLOCK_SIZE},     // a whole block
+        {3 * BLOCK_SIZE, 1},          // past the end: a hole before it
+        {2 * BLOCK_SIZE - 1, 1},      // the last byte of a block
+        {3 * BLOCK_SIZE + 1, 0},      // nothing, at the end
+    };
+    char c = 'a';
+    for (auto &w : writes) {
+        std::string data(w.len, c++);
+        CHECK(im.write_range(inum, w.off, data.data(), w.len) == (int)w.len,
+              "write_range at %u of %u failed", w.off, w.len);
+        if (model.size() < w.off + w.len)
+            model.resize(w.off + w.len, '\0');
+        model.replace(w.off, w.len, data);
+    }
+    extent_protocol::attr a;
+    im.getattr(inum, a);
+    CHECK(a.size == model.size(), "size %u, expected %zu", a.size,
+          model.size());
+    uint32_t bounds[] = {0, 1, BLOCK_SIZE - 1, BLOCK_SIZE, BLOCK_SIZE + 1,
+                         2 * BLOCK_SIZE, 3 * BLOCK_SIZE, 3 * BLOCK_SIZE + 1,
+                         3 * BLOCK_SIZE + 2, 10 * BLOCK_SIZE};
+    for (uint32_t off : bounds)
+        for (uint32_t end : bounds) {
+            if (end < off) continue;
+            std::string want =
+                off < model.size() ? model.substr(off, end - off) : "";
+            CHECK(read_at(im, inum, off, end - off) == want,
+                  "read of [%u, %u) has wrong contents", off, end);
+        }
+    // the end of the file may not go past 4 GiB
+    CHECK(im.write_range(inum, UINT32_MAX, "x", 1) == -EFBIG,
+          "a write past 4 GiB should fail with EFBIG");
+    CHECK(read_at(im, inum, UINT32_MAX - 1, 1).empty(),
+          "a read at the end of the offsets should be empty");
+    im.getattr(inum, a);
+    CHECK(a.size == model.size(), "a failed write changed the size");
+}
+
+// snapshots ----------------------------------------------------------
+
+// Take a snapshot, change files, and read the snapshot back, before and
+// after a remount, then drop it. With 512-byte blocks and 32768 inodes the
+// snapshot table takes 32 blocks, more than the superblock holds, so it
+// goes through an index block.
+static void test_snapshot_index() {
+    std::string path = image_path("snapshot");
+    geometry_t geo(512, 16384, 32768);
+    CHECK(geo.valid() && geo.snap_index_blocks == 1,
+          "geometry should need a snapshot index");
+    std::vector<uint32_t> inums;
+    {
+        inode_manager im(path.c_str(), geo);
+        // files spread over the inode table
+        for (int i = 0; i < 64; i++) {
+            uint32_t inum = im.alloc_inode(extent_protocol::T_FILE,
+                                           i * (32768 / 64));
+            std::string s = contents(0, i, 0);
+            im.write_file(inum, s.data(), s.size());
+            inums.push_back(inum);
+        }
+        CHECK(im.take_snapshot(), "take_snapshot failed");
+        for (int i = 0; i < 64; i++) {
+            std::string s = contents(0, i, 1);
+            im.write_file(inums[i], s.data(), s.size());
+        }
+        im.sync();
+    }
+    {
+        inode_manager im(path.c_str());
+        for (int i = 0; i < 64; i++) {
+            char *buf = NULL;
+            int size = 0;
+            im.read_file(inums[i], &buf, &size, true);
+            CHECK(std::string(buf, size) == contents(0, i, 0),
+                  "snapshot of %u has wrong contents", inums[i]);
+            free(buf);
+            im.read_file(inums[i], &buf, &size);
+            CHECK(std::string(buf, size) == contents(0, i, 1),
+                  "file %u has wrong contents", inums[i]);
+            free(buf);
+        }
+        fsck_report_t r;
+        CHECK(im.fsck(false, 2, r) == 0, "fsck with the snapshot");
+        CHECK(im.drop_snapshot(), "drop_snapshot failed");
+        CHECK(im.fsck(false, 2, r) == 0, "fsck after dropping the snapshot");
+    }
+    remove_image(path);
+}
+
+// delayed allocation ---------------------------------------------------
+
+// Fill a 2 MiB disk with 1 MiB writes: the ones there is no room for fail
+// with ENOSPC when they are made, and the data of the ones accepted is all
+// there once flushed, before and after a remount.
+static void test_delalloc_enospc(bool delalloc, bool whole) {
+    std::string path = image_path("enospc");
+    geometry_t geo(512, 4096, 512);
+    std::string data[4];
+    int accepted = 0;
+    std::vector<uint32_t> inums;
+    {
+        inode_manager im(path.c_str(), geo);
+        im.set_delalloc(delalloc);
+        for (int i = 0; i < 4; i++) {
+            uint32_t inum = im.alloc_inode(extent_protocol::T_FILE);
+            CHECK(inum != 0, "alloc_inode failed");
+            inums.push_back(inum);
+            data[i] = std::string(1 << 20, 'a' + i);
+            int r = whole ? im.write_file(inum, data[i].data(), data[i].size())
+                          : im.write_range(inum, 0, data[i].data(),
+                                           data[i].size());
+            if (r >= 0) {
+                CHECK(accepted == i, "write %d accepted after one failed", i);
+                accepted++;
+            } else {
+                CHECK(r == -ENOSPC, "write %d failed with %d, not ENOSPC", i,
+                      r);
+            }
+        }
+        CHECK(accepted == 1, "%d of 4 writes of 1 MiB accepted on 2 MiB",
+              accepted);
+        im.sync();
+        char *buf = NULL;
+        int size = 0;
+        im.read_file(inums[0], &buf, &size);
+        CHECK(std::string(buf, size) == data[0], "data lost by the flush");
+        free(buf);
+    }
+    {
+        inode_manager im(path.c_str());
+        char *buf = NULL;
+        int size = 0;
+        im.read_file(inums[0], &buf, &size);
+        CHECK(std::string(buf, size) == data[0], "data lost after remount");
+        free(buf);
+        for (int i = 1; i < 4; i++) {
+            extent_protocol::attr a;
+            im.getattr(inums[i], a);
+            CHECK(a.size == 0, "file %d failed to be written has %u bytes", i,
+                  a.size);
+        }
+        // and the room of a removed file can be written again
+        im.set_delalloc(delalloc);
+        im.remove_file(inums[0]);
+        CHECK(im.write_range(inums[1], 0, data[1].data(), data[1].size()) ==
+                  (int)data[1].size(),
+              "no room after a remove");
+        im.sync();
+        fsck_report_t r;
+        CHECK(im.fsck(false, 1, r) == 0, "fsck after ENOSPC");
+    }
+    remove_image(path);
+}
+
+// fsck -----------------------------------------------------------------
+
+// Read or write the slot of inode inum in image path straight from the
+// file, behind the back of any mount.
+static void image_inode(const std::string &path, const geometry_t &geo,
+                        uint32_t inum, inode_t *ino, bool write) {
+    int fd = open(path.c_str(), O_RDWR);
+    CHECK(fd >= 0, "open %s failed", path.c_str());
+    off_t off = (off_t)geo.iblock(inum) * geo.block_size +
+                inum % geo.ipb * sizeof(inode_t);
+    ssize_t n = write ? pwrite(fd, ino, sizeof(*ino), off)
+                      : pread(fd, ino, sizeof(*ino), off);
+    CHECK(n == sizeof(*ino), "inode %u of %s: i/o failed", inum,
+          path.c_str());
+    close(fd);
+}
+
+// Flip the bitmap bit of block b in image path.
+static void image_flip_bit(const std::string &path, const geometry_t &geo,
+                           uint32_t b) {
+    int fd = open(path.c_str(), O_RDWR);
+    CHECK(fd >= 0, "open %s failed", path.c_str());
+    off_t off = (off_t)geo.bblock(b) * geo.block_size + b % geo.bpb / 8;
+    unsigned char c;
+    CHECK(pread(fd, &c, 1, off) == 1, "bitmap of %s: read failed",
+          path.c_str());
+    c ^= 1 << (b % 8);
+    CHECK(pwrite(fd, &c, 1, off) == 1, "bitmap of %s: write failed",
+          path.c_str());
+    close(fd);
+}
+
+// Damage an image in every way fsck counts but conflicts: a leaked block,
+// a used block marked free, an inode with an extent off the disk (whose
+// block is then leaked too) and a free inode that is not clean. fsck must
+// find each, repair them, and leave the good file alone. While the image
+// is mounted, another process may not mount it.
+static void test_fsck_damaged() {
+    std::string path = image_path("fsck");
+    geometry_t geo;
+    uint32_t good, bad, unclean = INODE_NUM - 1;
+    std::string s = contents(0, 1, 0), one = contents(0, 0, 0);
+    {
+        inode_manager im(path.c_str(), geo);
+        good = im.alloc_inode(extent_protocol::T_FILE);
+        bad = im.alloc_inode(extent_protocol::T_FILE);
+        CHECK(good && bad, "alloc_inode failed");
+        im.write_file(good, s.data(), s.size());
+        im.write_file(bad, one.data(), one.size());
+        im.sync();
+    }
+    inode_t ino;
+    image_inode(path, geo, good, &ino, false);
+    CHECK(ino.nextents == 1 && ino.extents[0].len >= 2,
+          "file %u should be one extent of a few blocks", good);
+    image_flip_bit(path, geo, ino.extents[0].start + 1);
+    image_flip_bit(path, geo, geo.nblocks - 1);
+    image_inode(path, geo, bad, &ino, false);
+    ino.extents[0].start = geo.nblocks + 5;
+    image_inode(path, geo, bad, &ino, true);
+    image_inode(path, geo, unclean, &ino, false);
+    CHECK(ino.type == 0, "inode %u should be free", unclean);
+    ino.size = 7;
+    image_inode(path, geo, unclean, &ino, true);
+    // the checksums no longer match, have them rebuilt
+    unlink((path + ".crc").c_str());
+    {
+        inode_manager im(path.c_str());
+        pid_t pid = fork();
+        CHECK(pid >= 0, "fork failed");
+        if (pid == 0) _exit(image_in_use(path.c_str()) ? 0 : 1);
+        int status;
+        CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+                  WEXITSTATUS(status) == 0,
+              "a mounted image is not in use for another process");
+
+        fsck_report_t r;
+        CHECK(im.fsck(false, 2, r) == 5,
+              "fsck found %u bad, %u unclean, %u leaked, %u unmarked, %u "
+              "conflicts, %u refs",
+              r.bad_inodes, r.unclean, r.leaked, r.unmarked, r.conflicts,
+              r.bad_refs);
+        CHECK(r.bad_inodes == 1 && r.unclean == 1 && r.leaked == 2 &&
+                  r.unmarked == 1 && r.conflicts == 0 && r.bad_refs == 0,
+              "fsck counted the wrong problems");
+        CHECK(im.fsck(true, 2, r) == 5, "repair found different problems");
+        CHECK(im.fsck(false, 2, r) == 0, "problems left after the repair");
+        char *buf = NULL;
+        int size = 0;
+        im.read_file(good, &buf, &size);
+        CHECK(std::string(buf, size) == s, "repair damaged file %u", good);
+        free(buf);
+        extent_protocol::attr a;
+        im.getattr(bad, a);
+        CHECK(a.type == extent_protocol::T_FILE && a.size == 0,
+              "bad file %u should be cut to nothing, has %u bytes", bad,
+              a.size);
+        im.sync();
+    }
+    {
+        inode_manager im(path.c_str());
+        fsck_report_t r;
+        CHECK(im.fsck(false, 1, r) == 0, "fsck after the repair and remount");
+    }
+    remove_image(path);
+}
+
+// shared blocks -------------------------------------------------------
+
+// Blocks marked free in the bitmap of image path.
+static uint32_t image_free_blocks(const std::string &path,
+                                  const geometry_t &geo) {
+    int fd = open(path.c_str(), O_RDONLY);
+    CHECK(fd >= 0, "open %s failed", path.c_str());
+    std::vector<unsigned char> map(geo.bitmap_blocks * geo.block_size);
+    CHECK(pread(fd, map.data(), map.size(),
+                (off_t)geo.bblock(0) * geo.block_size) == (ssize_t)map.size(),
+          "bitmap of %s: read failed", path.c_str());
+    close(fd);
+    uint32_t n = 0;
+    for (uint32_t b = 0; b < geo.nblocks; b++)
+        if (!(map[b / 8] & 1 << (b % 8))) n++;
+    return n;
+}
+
+static std::string file_data(inode_manager &im, uint32_t inum) {
+    char *buf = NULL;
+    int size = 0;
+    CHECK(im.read_file(inum, &buf, &size) == 0, "read of %u failed", inum);
+    std::string s(buf, size);
+    free(buf);
+    return s;
+}
+
+// Clone a file and write the source and the clone at different blocks:
+// each keeps its own data, and removing either leaves the other whole and
+// the reference counts right. Removing both gives every block back.
+static void test_clone(bool remove_source) {
+    std::string path = image_path("clone");
+    geometry_t geo;
+    inode_manager im(path.c_str(), geo);
+    im.sync();
+    uint32_t before = image_free_blocks(path, geo);
+    std::string s(4 * BLOCK_SIZE, 0);
+    for (size_t i = 0; i < s.size(); i++) s[i] = 'a' + i % 26;
+    uint32_t src = im.alloc_inode(extent_protocol::T_FILE);
+    CHECK(src != 0, "alloc_inode failed");
+    CHECK(im.write_file(src, s.data(), s.size()) == 0, "write_file failed");
+    uint32_t clone = im.clone_file(src);
+    CHECK(clone != 0 && clone != src, "clone_file failed");
+    CHECK(file_data(im, clone) == s, "the clone differs from its source");
+
+    std::string a = s, b = s;
+    std::string pa(BLOCK_SIZE / 2, 'S'), pb(BLOCK_SIZE + 10, 'C');
+    CHECK(im.write_range(src, 10, pa.data(), pa.size()) == (int)pa.size(),
+          "write_range of the source failed");
+    a.replace(10, pa.size(), pa);
+    CHECK(im.write_range(clone, 2 * BLOCK_SIZE + 3, pb.data(), pb.size()) ==
+              (int)pb.size(),
+          "write_range of the clone failed");
+    b.replace(2 * BLOCK_SIZE + 3, pb.size(), pb);
+    CHECK(file_data(im, src) == a, "the source lost its own write");
+    CHECK(file_data(im, clone) == b, "the clone lost its own write");
+
+    fsck_report_t r;
+    CHECK(im.fsck(false, 1, r) == 0, "fsck after the writes: %u refs",
+          r.bad_refs);
+    im.remove_file(remove_source ? src : clone);
+    CHECK(im.fsck(false, 1, r) == 0 && r.bad_refs == 0,
+          "fsck after a remove: %u leaked, %u refs", r.leaked, r.bad_refs);
+    if (remove_source)
+        CHECK(file_data(im, clone) == b, "the clone changed with its source");
+    else
+        CHECK(file_data(im, src) == a, "the source changed with its clone");
+    im.remove_file(remove_source ? clone : src);
+    CHECK(im.fsck(false, 1, r) == 0, "fsck after both removes");
+    im.sync();
+    CHECK(image_free_blocks(path, geo) == before,
+          "%u blocks free before, %u after both removes", before,
+          image_free_blocks(path, geo));
+    remove_image(path);
+}
+
+#define DEDUP_FILES 8
+#define DEDUP_BLOCKS 8
+
+// Write the same data to several files with dedup on: only the first takes
+// blocks for it, the others share them. Removing the files one by one
+// leaves the rest whole, and the last one gives the blocks back.
+static void test_dedup() {
+    std::string path = image_path("dedup");
+    geometry_t geo;
+    inode_manager im(path.c_str(), geo);
+    im.set_dedup(true);
+    im.sync();
+    uint32_t before = image_free_blocks(path, geo);
+    std::string s;
+    for (int i = 0; i < DEDUP_BLOCKS; i++)
+        s += contents(0, i, 0).substr(0, BLOCK_SIZE);
+    std::vector<uint32_t> inums;
+    uint32_t first = 0;
+    for (int i = 0; i < DEDUP_FILES; i++) {
+        uint32_t inum = im.alloc_inode(extent_protocol::T_FILE);
+        CHECK(inum != 0, "alloc_inode failed");
+        CHECK(im.write_file(inum, s.data(), s.size()) == 0,
+              "write_file failed");
+        inums.push_back(inum);
+        im.sync();
+        if (i == 0) first = image_free_blocks(path, geo);
+    }
+    uint32_t after = image_free_blocks(path, geo);
+    CHECK(before - first >= DEDUP_BLOCKS,
+          "the first file took %u blocks for %u of data", before - first,
+          DEDUP_BLOCKS);
+    CHECK(after <= first && first - after <= 1,
+          "%u more files of the same data took %u blocks", DEDUP_FILES - 1,
+          first - after);
+
+    fsck_report_t r;
+    for (size_t i = 0; i < inums.size(); i++) {
+        im.remove_file(inums[i]);
+        CHECK(im.fsck(false, 1, r) == 0 && r.bad_refs == 0,
+              "fsck after %zu removes: %u leaked, %u refs", i + 1, r.leaked,
+              r.bad_refs);
+        for (size_t j = i + 1; j < inums.size(); j++)
+            CHECK(file_data(im, inums[j]) == s,
+                  "file %u changed by the remove of %u", inums[j], inums[i]);
+        im.sync();
+        if (i + 1 < inums.size())
+            CHECK(image_free_blocks(path, geo) <= first,
+                  "shared blocks freed with %zu files left",
+                  inums.size() - i - 1);
+    }
+    CHECK(image_free_blocks(path, geo) == before,
+          "%u blocks free before, %u after the removes", before,
+          image_free_blocks(path, geo));
+    remove_image(path);
+}
+
+// journal replay ------------------------------------------------------
+
+#define REPLAY_FILES 16
+
+// Rewrite the files in turn, round r taking file r % REPLAY_FILES, with a
+// scratch file created and removed along the way, and report every round
+// once its write is committed. Runs until it is killed.
+static void replay_writer(const std::string &path, int report) {
+    inode_manager im(path.c_str());
+    std::vector<uint32_t> inums;
+    for (int i = 0; i < REPLAY_FILES; i++)
+        inums.push_back(im.alloc_inode(extent_protocol::T_FILE));
+    CHECK(write(report, inums.data(), sizeof(uint32_t) * inums.size()) ==
+              (ssize_t)(sizeof(uint32_t) * inums.size()),
+          "report failed");
+    for (uint32_t r = 0;; r++) {
+        std::string s = contents(1, r % REPLAY_FILES, r);
+        CHECK(im.write_file(inums[r % REPLAY_FILES], s.data(), s.size()) == 0,
+              "write_file failed");
+        uint32_t scratch = im.alloc_inode(extent_protocol::T_FILE);
+        im.write_file(scratch, s.data(), s.size());
+        im.remove_file(scratch);
+        CHECK(write(report, &r, sizeof(r)) == sizeof(r), "report failed");
+    }
+}
+
+// Kill a writer in the middle of its run, then remount: the journal must
+// leave the image clean, with every file as its last committed write left
+// it but the one being written then, which may be either or fail its
+// checksum.
+static void test_replay() {
+    std::string path = image_path("replay");
+    int fds[2];
+    CHECK(pipe(fds) == 0, "pipe failed");
+    pid_t pid = fork();
+    CHECK(pid >= 0, "fork failed");
+    if (pid == 0) {
+        close(fds[0]);
+        replay_writer(path, fds[1]);
+    }
+    close(fds[1]);
+    std::vector<uint32_t> inums(REPLAY_FILES);
+    CHECK(read(fds[0], inums.data(), sizeof(uint32_t) * REPLAY_FILES) ==
+              sizeof(uint32_t) * REPLAY_FILES,
+          "the writer did not start");
+    uint32_t r;
+    CHECK(read(fds[0], &r, sizeof(r)) == sizeof(r), "no round committed");
+    usleep(300 * 1000);
+    kill(pid, SIGKILL);
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid && WIFSIGNALED(status),
+          "the writer should have been killed");
+    std::vector<int64_t> last(REPLAY_FILES, -1);
+    last[r % REPLAY_FILES] = r;
+    while (read(fds[0], &r, sizeof(r)) == sizeof(r))
+        last[r % REPLAY_FILES] = r;
+    close(fds[0]);
+    uint32_t busy = (r + 1) % REPLAY_FILES;
+
+    inode_manager im(path.c_str());
+    fsck_report_t rep;
+    CHECK(im.fsck(false, 1, rep) == 0,
+          "fsck after replay: %u bad, %u unclean, %u leaked, %u unmarked",
+          rep.bad_inodes, rep.unclean, rep.leaked, rep.unmarked);
+    for (uint32_t f = 0; f < REPLAY_FILES; f++) {
+        char *buf = NULL;
+        int size = 0;
+        int ret = im.read_file(inums[f], &buf, &size);
+        std::string got = ret == 0 ? std::string(buf, size) : "";
+        free(buf);
+        if (f == busy && (ret == -EIO || got == contents(1, f, r + 1)))
+            continue;
+        std::string want =
+            last[f] < 0 ? "" : contents(1, f, (uint32_t)last[f]);
+        CHECK(ret == 0 && got == want,
+              "file %u lost its last committed write, round %lld", f,
+              (long long)last[f]);
+    }
+}
+
+// checksums -----------------------------------------------------------
+
+// Flip a byte of block b in image path.
+static void image_flip_byte(const std::string &path, const geometry_t &geo,
+                            uint32_t b) {
+    int fd = open(path.c_str(), O_RDWR);
+    CHECK(fd >= 0, "open %s failed", path.c_str());
+    off_t off = (off_t)b * geo.block_size + 100;
+    unsigned char c;
+    CHECK(pread(fd, &c, 1, off) == 1, "block %u of %s: read failed", b,
+          path.c_str());
+    c ^= 0x20;
+    CHECK(pwrite(fd, &c, 1, off) == 1, "block %u of %s: write failed", b,
+          path.c_str());
+    close(fd);
+}
+
+// Write a file of three blocks, synced or, if crash, in a process that
+// exits without a sync, so that the checksums of its blocks are only in the
+// journal. Then flip a byte of its first block and remount: the reads of
+// that block must fail whether misses or all reads are checked, and the
+// other blocks still read.
+static void test_checksums(bool crash) {
+    std::string path = image_path("crc");
+    geometry_t geo;
+    std::string s = contents(0, 1, 0);
+    CHECK(geo.nblk(s.size()) == 3, "the file should take three blocks");
+    uint32_t inum = 0;
+    pid_t pid = crash ? fork() : 0;
+    CHECK(pid >= 0, "fork failed");
+    if (pid == 0) {
+        inode_manager im(path.c_str(), geo);
+        im.set_delalloc(false);
+        inum = im.alloc_inode(extent_protocol::T_FILE);
+        CHECK(im.write_file(inum, s.data(), s.size()) == 0,
+              "write_file failed");
+        if (crash) _exit(inum == 2 ? 0 : 1);
+        im.sync();
+    } else {
+        int status;
+        CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+                  WEXITSTATUS(status) == 0,
+              "the writer failed");
+        inum = 2;
+    }
+    inode_t ino;
+    image_inode(path, geo, inum, &ino, false);
+    CHECK(ino.nextents == 1 && ino.extents[0].len == 3,
+          "file %u should be one extent of three blocks", inum);
+    image_flip_byte(path, geo, ino.extents[0].start);
+    {
+        inode_manager im(path.c_str(), geo);
+        for (int mode : {VERIFY_MISS, VERIFY_ALL}) {
+            im.set_verify(mode);
+            char *buf = NULL;
+            int size = 0;
+            CHECK(im.read_file(inum, &buf, &size) == -EIO,
+                  "read_file of a damaged block should fail, mode %d", mode);
+            std::string blk(BLOCK_SIZE, '?');
+            CHECK(im.read_range(inum, 10, 10, &blk[0]) == -EIO,
+                  "read_range of a damaged block should fail, mode %d",
+                  mode);
+            CHECK(im.read_range(inum, BLOCK_SIZE, BLOCK_SIZE, &blk[0]) ==
+                          BLOCK_SIZE &&
+                      blk == s.substr(BLOCK_SIZE, BLOCK_SIZE),
+                  "a good block should read, mode %d", mode);
+        }
+        im.set_verify(VERIFY_NONE);
+        char *buf = NULL;
+        int size = 0;
+        CHECK(im.read_file(inum, &buf, &size) == 0 &&
+                  size == (int)s.size() && std::string(buf, size) != s,
+              "without checks the damaged data should read");
+        free(buf);
+    }
+    remove_image(path);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) dir = argv[1];
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    printf("striped inode locks, in memory: ");
+    {
+        inode_manager im;
+        test_stripes(&im);
+    }
+    printf("OK\n");
+
+    printf("striped inode locks, delayed allocation: ");
+    {
+        inode_manager im;
+        im.set_delalloc(true);
+        test_stripes(&im);
+    }
+    printf("OK\n");
+
+    printf("striped inode locks, with a journal: ");
+    {
+        std::string path = image_path("stripes");
+        {
+            inode_manager im(path.c_str());
+            test_stripes(&im);
+        }
+        {
+            // and the image mounts clean
+            inode_manager im(path.c_str());
+            fsck_report_t r;
+            CHECK(im.fsck(false, 1, r) == 0, "fsck after remount");
+        }
+        // unmounted here, so another process may mount it
+        CHECK(mounts_elsewhere(path), "the image is still in use");
+        remove_image(path);
+    }
+    printf("OK\n");
+
+    printf("ranged reads and writes at the boundaries: ");
+    test_ranges();
+    printf("OK\n");
+
+    printf("inode groups of more than 4096 inodes: ");
+    test_large_inode_groups();
+    printf("OK\n");
+
+    printf("snapshot table with an index: ");
+    test_snapshot_index();
+    printf("OK\n");
+
+    printf("ENOSPC with delayed allocation: ");
+    test_delalloc_enospc(true, false);
+    test_delalloc_enospc(true, true);
+    printf("OK\n");
+
+    printf("ENOSPC without delayed allocation: ");
+    test_delalloc_enospc(false, false);
+    test_delalloc_enospc(false, true);
+    printf("OK\n");
+
+    printf("fsck of a damaged image: ");
+    test_fsck_damaged();
+    printf("OK\n");
+
+    printf("copy on write of a clone: ");
+    test_clone(true);
+    test_clone(false);
+    printf("OK\n");
+
+    printf("dedup of identical files: ");
+    test_dedup();
+    printf("OK\n");
+
+    printf("journal replay after a crash: ");
+    test_replay();
+    printf("OK\n");
+
+    printf("checksums of a damaged block: ");
+    test_checksums(false);
+    printf("OK\n");
+
+    printf("checksums of a damaged block, after a crash: ");
+    test_checksums(true);
+    printf("OK\n");
+
+    printf("test-lab4-inode: passed all tests\n");
+    return 0;
+}
@@ -2,6 +2,7 @@
 #include "yfs_client.h"
 
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -188,34 +189,32 @@ int yfs_client::create(inum_t parent, const char *name, mode_t mode,
     uint32_t type =unlocked_get_type(parent);
     if (type != extent_protocol::T_DIR && type != extent_protocol::T_SYMLINK) {
         std::cerr << "parent is not dir or symlink\n";
+        releaseLock(parent);
         return IOERR;
     }
+    // the entry goes to dir, the target of parent if it is a symlink; the
+    // lock taken is still that of parent
+    inum_t dir = parent;
     if (type == extent_protocol::T_SYMLINK) {
         std::string path;
         readlink(parent, path);
-        path_to_inum(path, parent);
-        // std::cout << "\tSymlink: set target parent: " << parent << "\n";
-    }
-    std::string buf;
-    r = ec->get(parent, buf);
-    if (r != extent_protocol::OK) {
-        std::cerr << "read parent failed" << std::endl;
-        releaseLock(parent);
-        return r;
+        path_to_inum(path, dir);
+        // std::cout << "\tSymlink: set target parent: " << dir << "\n";
     }
     // create inode
     // FIXME: ec is not thread-safe, it may give the same inode to two different
     // yfs_client(whose parent is not the same) to the new file
-    if ((r = ec->create(extent_protocol::T_FILE, ino_out)) != OK) {
+    if ((r = ec->create(extent_protocol::T_FILE, ino_out, dir)) != OK) {
         std::cerr << "!ERR ec returns error " << r << std::endl;
         releaseLock(parent);
         return r;
     }
     // std::cout << "[yc] [CREATE] inode: " << ino_out << "\n";
-    // Add an entry to parent
-    buf.append(to_str(std::string(name), ino_out));
-    if ((r = ec->put(parent, buf)) != extent_protocol::OK) {
-        std::cerr << "!ERR ec put" << std::endl;
+    // Add an entry to dir, only it goes to the server, or give the new
+    // file back
+    if ((r = ec->dir_add(dir, name, ino_out)) != extent_protocol::OK) {
+        std::cerr << "!ERR ec dir_add" << std::endl;
+        discard(ino_out);
         releaseLock(parent);
         return r;
     }
@@ -237,16 +236,14 @@ int yfs_client::mkdir(inum_t parent, const char *name, mode_t mode,
         releaseLock(parent);
         return IOERR;
     }
-    std::string buf;
-    ec->get(parent, buf);
     // create inode
-    if (ec->create(extent_protocol::T_DIR, ino_out) != OK) {
+    if (ec->create(extent_protocol::T_DIR, ino_out, parent) != OK) {
         releaseLock(parent);
         return IOERR;
     }
-    // Add an entry to parent
-    buf.append(to_str(std::string(name), ino_out));
-    ec->put(parent, buf);
+    // Add an entry to parent, or give the new directory back
+    if ((r = ec->dir_add(parent, name, ino_out)) != extent_protocol::OK)
+        discard(ino_out);
     releaseLock(parent);
     return r;
 }
@@ -262,33 +259,13 @@ int yfs_client::lookup(inum_t parent, const char *name, bool &found,
 int yfs_client::unlockedLookup(inum_t parent, const char *name, bool &found,
                                inum_t &ino_out) {
     // std::cout << "[YC] [LOOKUP] " << name << " in " << parent << '\n';
-    int r = NOENT;
-
-    if (!isdir(parent)) return NOENT;
-
-    status s;
-    std::string buf;
-    if ((s = (ec->get(parent, buf))) != OK) {
-        // std::cout << "[YC] [READDIR] !ERR " << s << "\n";
-        return s;
-    }
-
-    while (!buf.empty()) {
-        size_t pos = buf.find('/');
-        std::string fname = buf.substr(0, pos);
-        buf.erase(0, pos + 1);
-        pos = buf.find('/');
-        std::string ino = (buf.substr(0, pos));
-        buf.erase(0, pos + 1);
-        if (fname == name) {
-            r = OK;
-            found = true;
-            ino_out = atoi(ino.c_str());
-            break;
-        }
-    }
-
-    return r;
+    // the server finds the entry, which is all that crosses the network,
+    // and fails if parent is not a directory
+    extent_protocol::extentid_t id;
+    if (ec->dir_lookup(parent, name, id) != extent_protocol::OK) return NOENT;
+    found = true;
+    ino_out = id;
+    return OK;
 }
 
 int yfs_client::readdir(inum_t dir, std::list<dirent> &list) {
@@ -303,32 +280,21 @@ int yfs_client::unlockedReaddir(inum_t dir, std::list<dirent> &list) {
     int r = OK;
 
     /*
-     * your code goes here.
-     * note: you should parse the directory content using your defined format,
-     * and push the dirents to the list.
+     * the entries come with the attributes of their files, which the
+     * extent client keeps for the getattr calls that follow a listing.
      */
-    std::string buf;
+    std::vector<extent_protocol::dirent> ents;
     status s;
-    if ((s = (ec->get(dir, buf))) != OK) {
-        // std::cout << "[YC] [READDIR] !ERR " << s << "\n";
+    if ((s = (ec->readdirplus(dir, ents))) != OK) {
+        if (s == IOERR) LOG("[YC] readdir %016llx: not a directory\n", dir);
         return s;
     }
-    if (isdir(dir)) {
-        while (!buf.empty()) {
-            size_t pos = buf.find('/');
-            std::string fname = buf.substr(0, pos);
-            buf.erase(0, pos + 1);
-            pos = buf.find('/');
-            std::string ino = (buf.substr(0, pos));
-            buf.erase(0, pos + 1);
-            dirent e;
-            e.name = fname;
-            e.inum = atoi(ino.c_str());
-            list.push_back(e);
-            // std::cout << "\tdir ent: " << e.name << "\t" << e.inum << "\n";
-        }
-    } else {
-        std::cout << "!!!!!!!!!!!!!!!readdir call to a file or symlink!\n";
+    for (const extent_protocol::dirent &ent : ents) {
+        dirent e;
+        e.name = ent.name;
+        e.inum = ent.id;
+        list.push_back(e);
+        // std::cout << "\tdir ent: " << e.name << "\t" << e.inum << "\n";
     }
     return r;
 }
@@ -337,16 +303,16 @@ int yfs_client::read(inum_t ino, size_t size, off_t off, std::string &data) {
     // std::cout << "[YC] [READ] " << ino << " size=" << size << " off=" << off
     //           << "\n";
     int r = OK;
-    std::string buf;
+    // offsets go over the wire as 32 bits, as far as a file can grow: a
+    // read past that stops there, as at the end of the file
+    if (off < 0) return IOERR;
+    data.clear();
+    if ((uint64_t)off >= UINT32_MAX) return OK;
+    size = std::min<uint64_t>(size, UINT32_MAX - off);
     lc->acquire(ino);
-    r = ec->get(ino, buf);
+    // only the range crosses the network, see extent_server::read
+    r = ec->read(ino, off, size, data);
     releaseLock(ino);
-    std::cout << "\tget OK: buf=" << buf << "\n";
-    if (off >= (long)buf.size())
-        data = "";
-    else
-        data = buf.substr(off, size);
-    std::cout << "data read " << data.size() << " bytes:\n" << data << "<\n";
     return r;
 }
 
@@ -355,38 +321,18 @@ int yfs_client::write(inum_t ino, size_t size, off_t off, const char *data,
     // std::cout << "[yc] [write] " << ino << " size=" << size << " off=" << off
     //           << "\n";
     int r = OK;
+    bytes_written = 0;
+    if (off < 0 || (uint64_t)off + size > UINT32_MAX) return FBIG;
     lc->acquire(ino);
 
     /*
-     * write using ec->put().
-     * when off > length of original file, fill the holes with '\0'.
+     * write only the range using ec->write().
+     * when off > length of original file, the gap reads as '\0'.
      */
-    std::string buf;
-    r = ec->get(ino, buf);
-    // std::cout << "origin size " << buf.size() << " original content:\n";
-    //   << buf << "|||\n";
-    if (off > (long)buf.size()) {
-        std::string tmp(data, size);
-        std::string new_data = std::string(off - buf.size(), '\0') + tmp;
-        buf += new_data;
-        bytes_written = new_data.length();
-        // std::cout << "write beyond buf, add 0's newsize=" << buf.size()
-        //           << " and buf is:\n"
-        //           << buf << std::endl;
-    } else {
-        std::string new_data(data, size);
-        // std::cout << "using replace policy size=" << size
-        //           << " data.size()=" << new_data.size() << std::endl;
-        buf.replace(off, size, new_data.substr(0, size));
-        bytes_written = size;
-    }
-    r = ec->put(ino, buf);
-    // std::cout << bytes_written << " bytes written, now size " << buf.size()
-    //           << " r=" << r << "\n";
-    //   << " updated:\n";
-    //   << buf << "|||\n";
+    int written = 0;
+    r = ec->write(ino, off, std::string(data, size), written);
+    if (r == extent_protocol::OK) bytes_written = written;
     releaseLock(ino);
-    VERIFY(r == extent_protocol::OK);
     return r;
 }
 
@@ -412,29 +358,16 @@ int yfs_client::unlink(inum_t parent, const char *name) {
         releaseLock(parent);
         return IOERR;
     }
-    std::list<dirent> flist;
-    // std::cout << "[YC] [UNLINK]->readdir\n";
-    unlockedReaddir(parent, flist);
-    for (std::list<dirent>::iterator i = flist.begin(); i != flist.end(); i++) {
-        if (i->name.compare(name) == 0) {
-            inum_t lid = i->inum;
-            lc->acquire(lid);
-            flist.erase(i);
-            ec->remove(i->inum);
-            std::string buf;
-            for (std::list<dirent>::iterator i = flist.begin();
-                 i != flist.end(); i++) {
-                buf.append(to_str(i->name, i->inum));
-            }
-            ec->put(parent, buf);
-            releaseLock(lid);
-            releaseLock(parent);
-            // std::cout << "[YC] [UNLINK] OK\n";
-            return OK;
-        }
+    inum_t lid;
+    if (ec->dir_remove(parent, name, lid) != extent_protocol::OK) {
+        releaseLock(parent);
+        return NOENT;
     }
-    r = NOENT;
+    lc->acquire(lid);
+    ec->remove(lid);
+    releaseLock(lid);
     releaseLock(parent);
+    // std::cout << "[YC] [UNLINK] OK\n";
     return r;
 }
 
@@ -444,18 +377,23 @@ int yfs_client::symlink(const char *link, inum_t parent, const char *name,
     // std::cout << "[YC] [SYMLINK] " << parent << " " << name << " " << link <<
     // "\n"; create a new file, write path(link) into it
     int r = OK;
-    if (!isdir(parent)) return IOERR;
-    std::string buf;
-    ec->get(parent, buf);
+    if (!isdir(parent)) {
+        releaseLock(parent);
+        return IOERR;
+    }
     // create inode
-    if (ec->create(extent_protocol::T_SYMLINK, ino_out) != OK) {
+    if (ec->create(extent_protocol::T_SYMLINK, ino_out, parent) != OK) {
+        releaseLock(parent);
         return IOERR;
     }
     // No need to lock since write itself would lock
     // lc->acquire(ino_out);
-    // Add an entry to parent
-    buf.append(to_str(std::string(name), ino_out));
-    ec->put(parent, buf);
+    // Add an entry to parent, or give the new file back
+    if ((r = ec->dir_add(parent, name, ino_out)) != extent_protocol::OK) {
+        discard(ino_out);
+        releaseLock(parent);
+        return r;
+    }
 
     // std::cout << "\t Create symlink file in parent ok\n";
     size_t written = 0;
@@ -464,14 +402,6 @@ int yfs_client::symlink(const char *link, inum_t parent, const char *name,
     return r;
 }
 
-std::string yfs_client::to_str(std::string fname, inum_t ino) {
-    std::string package(fname);
-    char buf[16];
-    sprintf(buf, "/%llu/", ino);
-    package.append(buf);
-    return package;
-}
-
 int yfs_client::path_to_inum(std::string path, inum_t &ino_out) {
     std::string target = path;
     inum_t p = 0;
@@ -504,7 +434,19 @@ void yfs_client::releaseLock(inum_t lockId) {
     lc->release(lockId);
 }
 
+// Remove a file just created that no directory names.
+void yfs_client::discard(inum_t ino) {
+    lc->acquire(ino);
+    ec->remove(ino);
+    releaseLock(ino);
+}
+
 int yfs_client::onLockRevoke(unsigned long long lockId) {
     ec->flush(lockId);
     return 0;
 }
+
+int yfs_client::onLockGrant(unsigned long long lockId) {
+    ec->lock_granted(lockId);
+    return 0;
+}
@@ -16,7 +16,8 @@
 class yfs_client {
    public:
     typedef unsigned long long inum_t;
-    enum xxstatus { OK, RPCERR, NOENT, IOERR, EXIST };
+    // the same values as extent_protocol's, which are passed through
+    enum xxstatus { OK, RPCERR, NOENT, IOERR, EXIST, NOSPC, FBIG };
     typedef int status;
 
     struct fileinfo {
@@ -43,10 +44,9 @@ class yfs_client {
     static std::string filename(inum_t);
     static inum_t n2i(std::string);
 
-    std::string to_str(std::string filename, inum_t ino);
-
     int path_to_inum(std::string path, inum_t &ino_out);
     void releaseLock(inum_t lockId);
+    void discard(inum_t ino);
 
    public:
     yfs_client();
@@ -85,6 +85,7 @@ class yfs_client {
      * Communication Link
      */
     int onLockRevoke(unsigned long long lid);
+    int onLockGrant(unsigned long long lid);
 };
 
 #endif
@@ -0,0 +1,81 @@
+#include "rpc.h"
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "extent_protocol.h"
+#include "inode_manager.h"
+
+// Check an extent image, see inode_manager::fsck:
+//   yfs_fsck [-y] [-j threads] image   an image no extent_server has open
+//   yfs_fsck [-y] [-j threads] -p port the extent_server on port, live
+// Nothing is written without -y. Exits 0 if the image was clean, 1 if
+// there were problems (repaired with -y), 2 on error.
+
+static void
+usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-y] [-j threads] image\n"
+          "       %s [-y] [-j threads] -p port\n", prog, prog);
+  exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+  bool repair = false;
+  int nthreads = 0;
+  char *port = NULL;
+  int c;
+
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  while((c = getopt(argc, argv, "yj:p:")) != -1){
+    switch(c){
+    case 'y': repair = true; break;
+    case 'j': nthreads = atoi(optarg); break;
+    case 'p': port = optarg; break;
+    default: usage(argv[0]);
+    }
+  }
+
+  int problems;
+  if(port != NULL){
+    if(optind != argc)
+      usage(argv[0]);
+    sockaddr_in dst;
+    make_sockaddr(port, &dst);
+    rpcc cl(dst);
+    if(cl.bind() != 0){
+      fprintf(stderr, "yfs_fsck: cannot reach extent_server on %s\n", port);
+      exit(2);
+    }
+    int ret = cl.call(extent_protocol::fsck, (int)repair, nthreads, problems);
+    if(ret != extent_protocol::OK){
+      fprintf(stderr, "yfs_fsck: fsck failed, %d\n", ret);
+      exit(2);
+    }
+    printf("yfs_fsck: %d problems, see the extent_server output\n", problems);
+  } else {
+    if(optind != argc - 1)
+      usage(argv[0]);
+    // an image is only mounted if it has a superblock, as a missing one
+    // would have it formatted
+    geometry_t geo;
+    if(image_in_use(argv[optind])){
+      fprintf(stderr, "yfs_fsck: %s is in use, check it with -p\n",
+              argv[optind]);
+      exit(2);
+    }
+    if(!probe_geometry(argv[optind], geo)){
+      fprintf(stderr, "yfs_fsck: %s is not an extent image\n", argv[optind]);
+      exit(2);
+    }
+    inode_manager im(argv[optind], geo);
+    fsck_report_t r;
+    problems = im.fsck(repair, nthreads, r);
+    if(repair)
+      im.sync();
+  }
+  exit(problems ? 1 : 0);
+}